@@ -1,6 +1,6 @@
 /* 
- * clock.c - Routines for using the cycle counters on x86, 
- *           Alpha, and Sparc boxes.
+ * clock.c - Routines for using the cycle counters on x86, x86-64,
+ *           AArch64, Alpha, and Sparc boxes.
  * 
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
@@ -9,14 +9,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/times.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 #include "clock.h"
 
 
 /******************************************************* 
  * Machine dependent functions 
  *
- * Note: the constants __i386__ and  __alpha
+ * Note: the constants __i386__, __x86_64__, __aarch64__ and __alpha
  * are set by GCC when it calls the C preprocessor
  * You can verify this for yourself using gcc -v.
  *******************************************************/
@@ -71,6 +75,110 @@ double get_counter()
 }
 /* $end x86cyclecounter */
 
+#elif defined(__x86_64__)
+/*********************************************************
+ * x86-64 versions of start_counter() and get_counter()
+ *********************************************************/
+
+static unsigned long long cyc_start = 0;
+
+/* 
+ * Read the time-stamp counter at the start of a measurement. The lfence
+ * keeps rdtsc from running before the instructions ahead of it finish.
+ */
+static inline unsigned long long counter_begin(void)
+{
+    unsigned hi, lo;
+
+    asm volatile("lfence; rdtsc" : "=a" (lo), "=d" (hi) : : "memory");
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+/* 
+ * Read it at the end. rdtscp waits for the measured code to finish, and
+ * the lfence after it keeps the code that follows from starting early.
+ */
+static inline unsigned long long counter_end(void)
+{
+    unsigned hi, lo, aux;
+
+    asm volatile("rdtscp; lfence" : "=a" (lo), "=d" (hi), "=c" (aux)
+		 : : "memory");
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+/* Record the current value of the cycle counter. */
+void start_counter()
+{
+    cyc_start = counter_begin();
+}
+
+/* Return the number of cycles since the last call to start_counter. */
+double get_counter()
+{
+    return (double)(counter_end() - cyc_start);
+}
+
+/*
+ * counter_mhz - The rate of an invariant TSC, as the processor reports it
+ *     in CPUID leaf 0x15, or 0 if it doesn't. Only an invariant TSC ticks
+ *     at a fixed rate whatever the core's clock does.
+ */
+static double counter_mhz(void)
+{
+    unsigned a, b, c, d;
+
+    if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1 << 8)))
+	return 0;
+    if (!__get_cpuid_count(0x15, 0, &a, &b, &c, &d) || !a || !b || !c)
+	return 0;
+    return (double)c * b / a / 1e6;
+}
+
+#elif defined(__aarch64__)
+/*********************************************************
+ * AArch64 versions of start_counter() and get_counter()
+ *********************************************************/
+
+static unsigned long long cyc_start = 0;
+
+/* 
+ * Read the virtual counter, which every core has and user code may
+ * read. The isb keeps it from being read ahead of earlier instructions.
+ */
+static inline unsigned long long counter_read(void)
+{
+    unsigned long long t;
+
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r" (t) : : "memory");
+    return t;
+}
+
+/* Record the current value of the counter. */
+void start_counter()
+{
+    cyc_start = counter_read();
+}
+
+/* Return the number of counter ticks since the last call to start_counter. */
+double get_counter()
+{
+    return (double)(counter_read() - cyc_start);
+}
+
+/*
+ * counter_mhz - The rate of the virtual counter. It ticks at a fixed
+ *     rate (cntfrq_el0), usually well below the core's clock, so here a
+ *     "cycle" is a tick of the counter.
+ */
+static double counter_mhz(void)
+{
+    unsigned long long f;
+
+    asm volatile("mrs %0, cntfrq_el0" : "=r" (f));
+    return f / 1e6;
+}
+
 #elif defined(__alpha)
 
 /****************************************************
@@ -179,6 +287,31 @@ double ovhd()
     return result;
 }
 
+/*
+ * read_counter - Read the counter without starting or stopping it, for
+ *     timing many short intervals: the time-stamp counter on x86, the
+ *     virtual counter on AArch64, and CLOCK_MONOTONIC nanoseconds
+ *     anywhere else. Only differences between two reads mean anything.
+ */
+unsigned long long read_counter(void)
+{
+#if defined(__i386__)
+    unsigned hi, lo;
+
+    access_counter(&hi, &lo);
+    return ((unsigned long long)hi << 32) | lo;
+#elif defined(__x86_64__)
+    return counter_begin();
+#elif defined(__aarch64__)
+    return counter_read();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
 /* $begin mhz */
 /* Estimate the clock rate by measuring the cycles that elapse */ 
 /* while sleeping for sleeptime seconds */
@@ -195,10 +328,45 @@ double mhz_full(int verbose, int sleeptime)
 }
 /* $end mhz */
 
-/* Version using a default sleeptime */
+/*
+ * mhz_timed - Estimate the clock rate by counting the cycles in ms
+ *     milliseconds of CLOCK_MONOTONIC. It keeps the processor busy,
+ *     unlike mhz_full, so a counter that follows the core's clock
+ *     is measured at the rate it runs at under load.
+ */
+static double mhz_timed(int ms)
+{
+    struct timespec t0, t1;
+    double us;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    start_counter();
+    do {
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+    } while (us < ms * 1e3);
+    return get_counter() / us;
+}
+
+/* 
+ * Find the clock rate: as the processor reports it where it can, and
+ * measured over a short busy interval elsewhere
+ */
 double mhz(int verbose)
 {
-    return mhz_full(verbose, 2);
+    double rate = 0;
+    char *how = "reported";
+
+#if defined(__x86_64__) || defined(__aarch64__)
+    rate = counter_mhz();
+#endif
+    if (rate == 0) {
+	rate = mhz_timed(50);
+	how = "measured";
+    }
+    if (verbose) 
+	printf("Processor clock rate ~= %.1f MHz (%s)\n", rate, how);
+    return rate;
 }
 
 /** Special counters that compensate for timer interrupt overhead */
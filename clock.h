@@ -6,10 +6,13 @@ void start_counter();
 /* Get # cycles since counter started */
 double get_counter();
 
+/* Read the raw counter, for differences between two reads */
+unsigned long long read_counter(void);
+
 /* Measure overhead for counter */
 double ovhd();
 
-/* Determine clock rate of processor (using a default sleeptime) */
+/* Determine clock rate of processor (reported, or timed over 50 ms) */
 double mhz(int verbose);
 
 /* Determine clock rate of processor, having more control over accuracy */
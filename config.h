@@ -58,15 +58,19 @@
 #define ALIGNMENT 8
 
 /*
- * Maximum heap size in bytes
+ * Default heap capacity in bytes. memlib only reserves this much address
+ * space and commits pages as the heap grows; mdriver -M overrides it.
  */
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
-#define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
+#define USE_FCYC   0   /* cycle counter w/K-best scheme (x86, x86-64,
+                          AArch64 & Alpha only) */
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
-#define USE_GETTOD 1   /* gettimeofday (any Unix box) */
+#define USE_GETTOD 0   /* gettimeofday (any Unix box) */
+#define USE_CLOCK  1   /* clock_gettime, repeated to a confidence interval
+                          (any POSIX box) */
 
 #endif /* __CONFIG_H */
@@ -2,6 +2,7 @@
  * High-level timing wrappers
  ****************************/
 #include <stdio.h>
+#include <string.h>
 #include "fsecs.h"
 #include "fcyc.h"
 #include "clock.h"
@@ -9,6 +10,7 @@
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+static fsecs_test_funct setup = NULL;  /* called before each run */
 
 extern int verbose; /* -v option in mdriver.c */
 
@@ -36,14 +38,46 @@ void init_fsecs(void)
 #elif USE_GETTOD
     if (verbose)
 	printf("Measuring performance with gettimeofday().\n");
+#elif USE_CLOCK
+    if (verbose)
+	printf("Measuring performance with CLOCK_MONOTONIC_RAW.\n");
+#endif
+}
+
+/*
+ * set_fsecs_setup - Set a function to call before every run of the
+ *     function being timed
+ */
+void set_fsecs_setup(fsecs_test_funct g)
+{
+    setup = g;
+#if USE_CLOCK
+    set_ftimer_setup(g);
 #endif
 }
 
+/* setup_run - A run of the function being timed, after its setup */
+#if !USE_CLOCK
+static fsecs_test_funct run;  /* the function being timed */
+
+static void setup_run(void *argp)
+{
+    setup(argp);
+    run(argp);
+}
+#endif
+
 /*
  * fsecs - Return the running time of a function f (in seconds)
  */
 double fsecs(fsecs_test_funct f, void *argp) 
 {
+#if !USE_CLOCK
+    if (setup) {
+	run = f;
+	f = setup_run;
+    }
+#endif
 #if USE_FCYC
     double cycles = fcyc(f, argp);
     return cycles/(Mhz*1e6);
@@ -51,6 +85,24 @@ double fsecs(fsecs_test_funct f, void *argp)
     return ftimer_itimer(f, argp, 10);
 #elif USE_GETTOD
     return ftimer_gettod(f, argp, 10);
+#elif USE_CLOCK
+    ftimer_stats_t st;
+
+    return ftimer_clock(f, argp, &st);
+#endif 
+}
+
+/*
+ * fsecs_stats - Return the running time of a function f (in seconds),
+ *     and how much it varied from run to run
+ */
+double fsecs_stats(fsecs_test_funct f, void *argp, struct ftimer_stats *st) 
+{
+#if USE_CLOCK
+    return ftimer_clock(f, argp, st);
+#else
+    memset(st, 0, sizeof(*st));
+    return fsecs(f, argp);
 #endif 
 }
 
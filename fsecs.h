@@ -1,4 +1,15 @@
 typedef void (*fsecs_test_funct)(void *);
 
+struct ftimer_stats;
+
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+
+/* fsecs, also filling in *st with the spread of the runs behind the
+   estimate. Only the USE_CLOCK timer measures that; the others set
+   st->runs to 0. */
+double fsecs_stats(fsecs_test_funct f, void *argp, struct ftimer_stats *st);
+
+/* Call g(argp) before every run of f; NULL for none. Only the USE_CLOCK
+   timer leaves it out of the time; the others time runs in batches. */
+void set_fsecs_setup(fsecs_test_funct g);
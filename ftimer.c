@@ -7,14 +7,34 @@
  * Function timers that estimate the running time (in seconds) of a function f.
  *    ftimer_itimer: version that uses the interval timer
  *    ftimer_gettod: version that uses gettimeofday
+ *    ftimer_clock: version that uses CLOCK_MONOTONIC_RAW, timing each
+ *        run and repeating until the mean is known well enough
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
 #include <sys/time.h>
 #include "ftimer.h"
 
+/* Default values for ftimer_clock */
+#define WARMUP    2      /* untimed runs first */
+#define MINRUNS   5      /* fewest timed runs */
+#define MAXRUNS   1000   /* most timed runs */
+#define MAXSECS   2.0    /* stop adding runs after this many seconds */
+#define CI        0.01   /* target 95% confidence interval, +/- of mean */
+#define OUTLIER   5.0    /* runs this many MADs above the median are dropped */
+
+static int warmup = WARMUP;
+static double target_ci = CI;
+static ftimer_test_funct setup = NULL;
+
 /* function prototypes */
 static void init_etime(void);
 static double get_etime(void);
+static void summarize(double *t, int n, ftimer_stats_t *st);
+static int cmp_double(const void *a, const void *b);
 
 /* 
  * ftimer_itimer - Use the interval timer to estimate the running time
@@ -53,6 +73,138 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n)
 }
 
 
+/* 
+ * ftimer_clock - Use CLOCK_MONOTONIC_RAW to estimate the running time of
+ * f(argp). After the warm-up runs, time one run at a time until the 95%
+ * confidence interval of the mean is within target_ci of it, or the runs
+ * or seconds run out. Runs far slower than the median, which something
+ * else interrupted, are dropped. Return the median and fill in *st.
+ */
+double ftimer_clock(ftimer_test_funct f, void *argp, ftimer_stats_t *st)
+{
+    double *t, start, total = 0;
+    int i, n;
+
+    if ((t = malloc(MAXRUNS * sizeof(double))) == NULL) {
+	fprintf(stderr, "Fatal error.  Malloc returned null in ftimer_clock\n");
+	exit(1);
+    }
+    for (i = 0; i < warmup; i++) {
+	if (setup)
+	    setup(argp);
+	f(argp);
+    }
+    for (n = 0; n < MAXRUNS; ) {
+	if (setup)
+	    setup(argp);
+	start = ftimer_now();
+	f(argp);
+	t[n] = ftimer_now() - start;
+	total += t[n++];
+	if (n < MINRUNS)
+	    continue;
+	summarize(t, n, st);
+	if (st->ci <= target_ci * st->mean || total >= MAXSECS)
+	    break;
+    }
+    summarize(t, n, st);
+    free(t);
+    return st->median;
+}
+
+/*
+ * set_ftimer_warmup - Untimed runs before ftimer_clock starts timing
+ *     Default = 2
+ */
+void set_ftimer_warmup(int n)
+{
+    warmup = n;
+}
+
+/*
+ * set_ftimer_ci - Relative half width of the 95% confidence interval
+ *     that ftimer_clock aims for
+ *     Default = 0.01
+ */
+void set_ftimer_ci(double rel)
+{
+    target_ci = rel;
+}
+
+/*
+ * set_ftimer_setup - Function that ftimer_clock calls before each run,
+ *     outside the timed interval
+ *     Default = none
+ */
+void set_ftimer_setup(ftimer_test_funct g)
+{
+    setup = g;
+}
+
+/* 
+ * ftimer_now - Return CLOCK_MONOTONIC_RAW in seconds
+ */
+double ftimer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * summarize - Fill in *st from the n run times in t, which it sorts
+ */
+static void summarize(double *t, int n, ftimer_stats_t *st)
+{
+    /* Two-sided 95% Student t for 1..30 degrees of freedom */
+    static const double t95[] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+	2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101,
+	2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052,
+	2.048, 2.045, 2.042};
+    double *dev, mad, var, sum = 0, sq = 0;
+    int i, kept;
+
+    qsort(t, n, sizeof(double), cmp_double);
+    st->min = t[0];
+    st->median = (n & 1) ? t[n/2] : (t[n/2 - 1] + t[n/2]) / 2;
+
+    /* Drop the runs far above the median, measured in MADs */
+    if ((dev = malloc(n * sizeof(double))) == NULL) {
+	fprintf(stderr, "Fatal error.  Malloc returned null in summarize\n");
+	exit(1);
+    }
+    for (i = 0; i < n; i++)
+	dev[i] = fabs(t[i] - st->median);
+    qsort(dev, n, sizeof(double), cmp_double);
+    mad = 1.4826 * ((n & 1) ? dev[n/2] : (dev[n/2 - 1] + dev[n/2]) / 2);
+    free(dev);
+    for (kept = n; kept > 1 && t[kept-1] > st->median + OUTLIER * mad; )
+	kept--;
+    if (mad == 0)
+	kept = n;
+
+    for (i = 0; i < kept; i++) {
+	sum += t[i];
+	sq += t[i] * t[i];
+    }
+    st->runs = kept;
+    st->outliers = n - kept;
+    st->mean = sum / kept;
+    var = (kept > 1) ? (sq - sum * st->mean) / (kept - 1) : 0;
+    st->stddev = (var > 0) ? sqrt(var) : 0;
+    st->ci = (kept > 1) ? 
+	((kept <= 31) ? t95[kept - 2] : 1.96) * st->stddev / sqrt(kept) : 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
 /*
  * Routines for manipulating the Unix interval timer
  */
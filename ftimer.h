@@ -12,3 +12,28 @@ double ftimer_itimer(ftimer_test_funct f, void *argp, int n);
    Return the average of n runs */
 double ftimer_gettod(ftimer_test_funct f, void *argp, int n);
 
+
+/* What ftimer_clock measured, in seconds */
+typedef struct ftimer_stats {
+    int runs;       /* timed runs kept */
+    int outliers;   /* timed runs dropped as far slower than the median */
+    double median, mean, min, stddev;
+    double ci;      /* half width of the 95% confidence interval of the mean */
+} ftimer_stats_t;
+
+/* Estimate the running time of f(argp) using CLOCK_MONOTONIC_RAW, 
+   repeating until the mean is known to within the target interval.
+   Return the median run and fill in *st */
+double ftimer_clock(ftimer_test_funct f, void *argp, ftimer_stats_t *st);
+
+/* CLOCK_MONOTONIC_RAW in seconds, the clock ftimer_clock times with */
+double ftimer_now(void);
+
+/* Set the untimed warm-up runs (default 2) and the relative confidence
+   interval to aim for (default 0.01) */
+void set_ftimer_warmup(int n);
+void set_ftimer_ci(double rel);
+
+/* Have ftimer_clock call g(argp), untimed, before every run of f;
+   NULL for none */
+void set_ftimer_setup(ftimer_test_funct g);
@@ -0,0 +1,35 @@
+/*
+ * heapmap.h - Heap map files, written by mdriver -m and drawn by heapview.
+ *
+ * A heap map file holds snapshots of a heap taken as a trace runs. Each
+ * snapshot is a header followed by one record for every block of the
+ * heap, in address order. The numbers are in the byte order of the host
+ * that wrote the file.
+ */
+#include <stdint.h>
+
+#define HEAPMAP_MAGIC   0x70616d68   /* "hmap" */
+#define HEAPMAP_VERSION 1
+
+/* Header of a snapshot */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t op;           /* requests made before the snapshot */
+    uint64_t heapsize;     /* bytes in the heap */
+    uint64_t payload;      /* live payload bytes the trace asked for */
+    uint64_t num_blocks;   /* records that follow */
+} heapmap_hdr_t;
+
+/* A block of the heap, laid out as mm_block_t in mm.h */
+typedef struct {
+    uint32_t offset;       /* of the block's header from the heap's start */
+    uint32_t size;         /* bytes, header and footer included */
+    uint8_t flags;         /* HEAPMAP_xxx */
+    uint8_t cls;           /* segregated class of its size */
+    uint16_t pad;
+} heapmap_rec_t;
+
+#define HEAPMAP_ALLOC   0x1  /* allocated, else free */
+#define HEAPMAP_TAG     0x2  /* free but held back for a realloc */
+#define HEAPMAP_MOVABLE 0x4  /* movable if allocated, released if free */
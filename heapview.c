@@ -0,0 +1,250 @@
+/*
+ * heapview.c - Draw the heap maps mdriver -m writes. Each snapshot is a
+ *     strip of cells, each cell standing for an equal share of the heap
+ *     and showing how much of it is allocated: ' ' free, '.' '-' '+' '#'
+ *     a quarter, half, three quarters or all of it, in color on a
+ *     terminal. A cell with a little allocated in a lot of free space is
+ *     pinned: the free space around it can't be given back or merged
+ *     while the block lives. Pinned cells are marked '!'.
+ *
+ *     With -p, the snapshots are also drawn into a PPM image, one band of
+ *     rows each, one pixel for every -w'th of the heap: allocated red,
+ *     tagged purple, pinned yellow and free dark grey.
+ *
+ *     usage: heapview [-w <cells>] [-p <out.ppm>] <heapmap file>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "heapmap.h"
+
+#define WIDTH  64     /* default cells in a strip */
+#define PINNED 0.1    /* a cell at most this allocated (but some) is pinned */
+#define BAND   8      /* rows of pixels per snapshot in the image */
+
+/* What a cell holds, in bytes */
+typedef struct {
+    double alloc;     /* allocated */
+    double tag;       /* free but tagged */
+} cell_t;
+
+static void fill_cells(heapmap_hdr_t *hdr, heapmap_rec_t *recs,
+		       cell_t *cells, int width);
+static int pinned(cell_t *c, double cellsize);
+static void draw_strip(heapmap_hdr_t *hdr, heapmap_rec_t *recs,
+		       cell_t *cells, int width, int color);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+    heapmap_hdr_t hdr;
+    heapmap_rec_t *recs = NULL;
+    cell_t *cells, *c;
+    FILE *fp, *img = NULL, *pix = NULL;
+    char *ppmfile = NULL;
+    unsigned char rgb[3];
+    uint64_t max = 0;
+    long snaps = 0, i, r;
+    int width = WIDTH, color, ch;
+    double cellsize;
+
+    while ((ch = getopt(argc, argv, "w:p:h")) != EOF) {
+	switch (ch) {
+	case 'w':
+	    if ((width = atoi(optarg)) < 1)
+		usage();
+	    break;
+	case 'p':
+	    ppmfile = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1)
+	usage();
+    if ((fp = fopen(argv[optind], "r")) == NULL) {
+	fprintf(stderr, "Could not open %s: %s\n", argv[optind],
+		strerror(errno));
+	exit(1);
+    }
+    if ((cells = malloc(width * sizeof(cell_t))) == NULL) {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+
+    /*
+     * The image's height is known only at the end, so its pixels go to a
+     * temporary file and are copied in behind the header
+     */
+    if (ppmfile && (pix = tmpfile()) == NULL) {
+	fprintf(stderr, "Could not create a temporary file: %s\n",
+		strerror(errno));
+	exit(1);
+    }
+
+    color = isatty(STDOUT_FILENO);
+    while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+	if (hdr.magic != HEAPMAP_MAGIC || hdr.version != HEAPMAP_VERSION) {
+	    fprintf(stderr, "%s: not a version %d heap map\n", argv[optind],
+		    HEAPMAP_VERSION);
+	    exit(1);
+	}
+	if (hdr.num_blocks > max) {
+	    max = hdr.num_blocks;
+	    if ((recs = realloc(recs, max * sizeof(heapmap_rec_t))) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	    }
+	}
+	if (fread(recs, sizeof(heapmap_rec_t), hdr.num_blocks, fp) !=
+	    hdr.num_blocks) {
+	    fprintf(stderr, "%s: truncated\n", argv[optind]);
+	    exit(1);
+	}
+	fill_cells(&hdr, recs, cells, width);
+	draw_strip(&hdr, recs, cells, width, color);
+
+	if (pix) {
+	    cellsize = (double)hdr.heapsize / width;
+	    for (r = 0; r < BAND; r++) {
+		for (i = 0; i < width; i++) {
+		    c = &cells[i];
+		    if (r == BAND - 1) {            /* gap between bands */
+			rgb[0] = rgb[1] = rgb[2] = 0;
+		    } else if (pinned(c, cellsize)) {
+			rgb[0] = 255; rgb[1] = 220; rgb[2] = 0;
+		    } else {
+			rgb[0] = 48 + 207 * (c->alloc + c->tag) / cellsize;
+			rgb[1] = 48 - 48 * (c->alloc + c->tag) / cellsize;
+			rgb[2] = 48 + 160 * c->tag / cellsize;
+		    }
+		    fwrite(rgb, 3, 1, pix);
+		}
+	    }
+	}
+	snaps++;
+    }
+    fclose(fp);
+    if (snaps == 0) {
+	fprintf(stderr, "%s: no heap maps\n", argv[optind]);
+	exit(1);
+    }
+
+    if (ppmfile) {
+	if ((img = fopen(ppmfile, "w")) == NULL) {
+	    fprintf(stderr, "Could not create %s: %s\n", ppmfile,
+		    strerror(errno));
+	    exit(1);
+	}
+	fprintf(img, "P6\n%d %ld\n255\n", width, snaps * BAND);
+	rewind(pix);
+	while ((ch = getc(pix)) != EOF)
+	    putc(ch, img);
+	fclose(pix);
+	if (ferror(img) || fclose(img) != 0) {
+	    fprintf(stderr, "Could not write %s: %s\n", ppmfile,
+		    strerror(errno));
+	    exit(1);
+	}
+    }
+    free(cells);
+    free(recs);
+    exit(0);
+}
+
+/*
+ * fill_cells - Share the bytes of each block out over the cells it covers
+ */
+static void fill_cells(heapmap_hdr_t *hdr, heapmap_rec_t *recs,
+		       cell_t *cells, int width)
+{
+    double cellsize = (double)hdr->heapsize / width;
+    double lo, hi, end;
+    uint64_t b;
+    int i;
+
+    memset(cells, 0, width * sizeof(cell_t));
+    if (hdr->heapsize == 0)
+	return;
+    for (b = 0; b < hdr->num_blocks; b++) {
+	if (!(recs[b].flags & (HEAPMAP_ALLOC | HEAPMAP_TAG)))
+	    continue;
+	lo = recs[b].offset;
+	end = lo + recs[b].size;
+	for (i = lo / cellsize; (i < width) && (lo < end); i++) {
+	    hi = (i + 1) * cellsize;
+	    if (hi > end)
+		hi = end;
+	    if (recs[b].flags & HEAPMAP_ALLOC)
+		cells[i].alloc += hi - lo;
+	    else
+		cells[i].tag += hi - lo;
+	    lo = hi;
+	}
+    }
+}
+
+/* pinned - Does a little allocated hold a cell's free space? */
+static int pinned(cell_t *c, double cellsize)
+{
+    return (c->alloc > 0) && (c->alloc + c->tag <= PINNED * cellsize);
+}
+
+/*
+ * draw_strip - Print a line of figures for a snapshot and its strip
+ */
+static void draw_strip(heapmap_hdr_t *hdr, heapmap_rec_t *recs,
+		       cell_t *cells, int width, int color)
+{
+    static const char *shades[] = {" ", ".", "-", "+", "#"};
+    static const char *colors[] = {"40", "44", "46", "43", "41"};
+    double cellsize = (double)hdr->heapsize / width;
+    uint64_t b, largest = 0, nfree = 0, npinned = 0;
+    int i, s;
+
+    for (b = 0; b < hdr->num_blocks; b++)
+	if (!(recs[b].flags & HEAPMAP_ALLOC)) {
+	    nfree++;
+	    if (recs[b].size > largest)
+		largest = recs[b].size;
+	}
+    for (i = 0; i < width; i++)
+	npinned += pinned(&cells[i], cellsize);
+
+    printf("op %llu: heap %llu KB, util %.1f%%, %llu blocks (%llu free), "
+	   "largest free %llu KB, %llu of %d cells pinned\n",
+	   (unsigned long long)hdr->op,
+	   (unsigned long long)hdr->heapsize >> 10,
+	   hdr->heapsize ? 100.0 * hdr->payload / hdr->heapsize : 0.0,
+	   (unsigned long long)hdr->num_blocks, (unsigned long long)nfree,
+	   (unsigned long long)largest >> 10, (unsigned long long)npinned,
+	   width);
+    putchar('|');
+    for (i = 0; i < width; i++) {
+	s = (cells[i].alloc + cells[i].tag) / cellsize * 4 + 0.5;
+	if (s > 4)
+	    s = 4;
+	if ((s == 0) && (cells[i].alloc + cells[i].tag > 0))
+	    s = 1;
+	if (pinned(&cells[i], cellsize))
+	    printf(color ? "\033[30;43m!\033[0m" : "!");
+	else if (color)
+	    printf("\033[%sm%s\033[0m", colors[s], shades[s]);
+	else
+	    fputs(shades[s], stdout);
+    }
+    printf("|\n");
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: heapview [-w <cells>] [-p <out.ppm>] <heapmap file>\n");
+    fprintf(stderr, "\t-w <cells>  Draw each heap map this many cells wide (default %d).\n", WIDTH);
+    fprintf(stderr, "\t-p <file>   Also draw the heap maps into a PPM image.\n");
+    exit(1);
+}
@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE      /* for sched_setaffinity and sched_getcpu */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,12 +15,24 @@
 #include <string.h>
 #include <assert.h>
 #include <float.h>
+#include <math.h>
+#include <limits.h>
 #include <time.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sched.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "ftimer.h"
+#include "clock.h"
+#include "perfctr.h"
+#include "heapmap.h"
 #include "config.h"
+#include "tracefmt.h"
 
 /**********************
  * Constants and macros
@@ -27,39 +40,62 @@
 
 /* Misc */
 #define MAXLINE     1024 /* max string size */
+#define MAXBUDGETS    32 /* max number of fit budgets swept by -k */
+#define MAXMAPS       64 /* max number of heap map requests given to -m */
+#define MAXJOBS      256 /* max number of worker processes (-j) */
+#define MAXTHREADS    64 /* max threads in a threaded trace (-T) */
+#define REPLAYS        3 /* threaded replays per thread count, best kept */
+#define PERF_RUNS      3 /* runs averaged when counting events (-P) */
+#define MAXSAMPLES    32 /* max processes timing each trace (-R) */
+#define REGRESS_MIN 0.05 /* least slowdown flagged against a baseline (-b) */
+#define UTIL_TOL   0.001 /* least utilization drop flagged (-b) */
 #define HDRLINES       4 /* number of header lines in a trace file */
-#define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define LAT_SUB_BITS   5 /* latency histograms (-L) have 2^5 buckets... */
+#define LAT_BUCKETS (64 << LAT_SUB_BITS) /* ... per power of two */
+#define LAT_KINDS      4 /* malloc, realloc, free, other */
+#define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1);
+			    for a binary trace, the line in its .rep form */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload. The ranges form a treap
+ * (a binary search tree on lo that is also a heap on a random priority),
+ * so finding a block's neighbours takes O(log n) expected time.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    unsigned int prio;     /* random heap priority */
+    struct range_t *left;  /* ranges with lower lo */
+    struct range_t *right; /* ranges with higher lo */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
     int num_ids;         /* number of alloc/realloc ids */
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    tracefile_t file;    /* the requests, parsed or mapped */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    int *handles;        /* mm_halloc handle of each block, -1 if none */
+    int num_regions;     /* number of region ids */
+    mm_region_t **regions; /* region of each region id */
+    int *region_heads;   /* first block of each region, -1 if none... */
+    int *region_next;    /* ... and the next block in the same region */
+
+    /* Used only when the trace is streamed (-s) */
+    char **live;         /* block of each id as the replay last saw it */
+    size_t *filled;      /* leading bytes of each block known to hold
+			    the low byte of its id */
+    unsigned *epoch;     /* last run of ops that touched each id */
 } trace_t;
 
 /* 
@@ -72,19 +108,96 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* 
+ * The latencies of one kind of request (-L). Buckets are log-linear, as
+ * in an HDR histogram: exact below 2^LAT_SUB_BITS ticks, then 2^LAT_SUB_BITS
+ * to each power of two, so any latency is known to within about 3%.
+ */
+typedef struct {
+    long count;
+    double sum;                  /* total ticks */
+    unsigned long long min, max;
+    long buckets[LAT_BUCKETS];
+} lathist_t;
+
+/* The mm results of one trace in a baseline (-b) */
+typedef struct {
+    char trace[MAXLINE];
+    int valid;
+    double util;
+    double secs;
+    double samples[MAXSAMPLES]; /* secs measured by each process (-R) */
+    int num_samples;
+} baseline_t;
+
+/* One thread's requests in a threaded trace (-T) */
+typedef struct {
+    traceop_t *ops;      /* the thread's a, f, r, s and w requests */
+    int num_ops;
+    int next;            /* next request to replay */
+} tstream_t;
+
+/* A trace split up by thread for threaded replay */
+typedef struct {
+    int num_threads;     /* threads in the trace */
+    tstream_t *streams;  /* the requests of each thread */
+    int num_ids;
+    int num_events;
+    char **blocks;       /* block of each id, shared by all threads */
+    int *posted;         /* has each event been posted? */
+    int failed;          /* set when an allocator call fails */
+} mtrace_t;
+
+/* A pthread of a threaded replay, and what it measured */
+typedef struct {
+    mtrace_t *mt;
+    int id;              /* replays the streams id, id + workers, ... */
+    int workers;
+    long ops;            /* allocator requests it made */
+    double start, stop;  /* ftimer_now() when it started and finished */
+} replayer_t;
+
+/* 
+ * What a worker process reports about one trace (-j). The parent reads
+ * it from memory it shares with the workers.
+ */
+typedef struct result_t result_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
     double ops;      /* number of ops (malloc/free/realloc) in the trace */
     int valid;       /* was the trace processed correctly by the allocator? */
     double secs;     /* number of secs needed to run the trace */
+    double secs_min; /* fastest run, and the standard deviation and */
+    double secs_sd;  /* 95% confidence interval (+/-) of the runs, */
+    double secs_ci;  /* where the timer measures them */
+    int runs;        /* runs timed, 0 if the spread is unknown */
+    double samples[MAXSAMPLES]; /* median secs of each process that */
+    int num_samples;            /* timed the trace (-R); secs is theirs */
+    double perf[PERF_EVENTS]; /* events counted in a run (-P), -1 for
+				 counters that aren't available */
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double util_tw;  /* payload over heap size, averaged over the requests */
+    double rss;      /* peak resident heap bytes */
+    double rss_util; /* peak payload over peak resident bytes */
+    double lat_p50;  /* median, 99th and 99.9th percentile ns of a */
+    double lat_p99;  /* request, if measured (-L) */
+    double lat_p999;
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+struct result_t {
+    stats_t stats;   /* the stats of the trace */
+    int done;        /* did the worker finish the trace? */
+    int errors;      /* errors it found in the trace */
+    int cpu;         /* CPU the trace ran on */
+    long preempted;  /* involuntary context switches while it ran */
+};
+
 /********************
  * Global variables
  *******************/
@@ -100,20 +213,77 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+/* Heap capacity in MB (-M) */
+static size_t heap_mb = MAX_HEAP >> 20;
+
+/* If set, stream each trace through the mm package in one pass (-s) */
+static int streaming = 0;
+
+/* Number of worker processes that evaluate traces side by side (-j) */
+static int jobs = 1;
+
+/* Most threads to replay threaded traces on, 0 for none (-T) */
+static int max_threads = 0;
+
+/* If set, time every request of each trace (-L) */
+static int latency = 0;
+
+/* If set, count hardware events while each trace runs (-P) */
+static int perf = 0;
+
+/* Requests between samples of the heap's utilization, 0 for none (-u) */
+static long util_every = 0;
+
+/* Requests between snapshot/restore checks of the heap, 0 for none (-S) */
+static long snap_every = 0;
+
+/* Processes that replay each trace together on a shared heap, 0 for
+   none (-A) */
+static int shared_procs = 0;
+
+/* Processes that each time every trace, so -o records the spread
+   between whole runs and not just between runs in one process (-R) */
+static int time_procs = 1;
+
+/* What the compactions in the util run of a trace did, reported once
+   per trace with -v */
+static struct {
+    int count;
+    size_t first, last;    /* heap bytes before the first, after the last */
+    double util_first, util_last;
+} compactions;
+
+/* Requests after which to take heap maps (-m), in order, and every how
+   many requests to take one, 0 for none */
+static long map_ops[MAXMAPS];
+static int num_map_ops = 0;
+static long map_every = 0;
+
+/* What each op of the current chunk returned, and the ids it touched */
+static char *stream_res[TRACE_CHUNK];
+static int stream_touched[TRACE_CHUNK];
+
 
 /********************* 
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size, 
-		     int tracenum, int opnum);
+		     int tracenum, long opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static void split_ranges(range_t *t, char *lo, range_t **l, range_t **r);
+static range_t *merge_ranges(range_t *l, range_t *r);
+static int check_fill(const char *p, int n, int c);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
 static void free_trace(trace_t *trace);
+static void reset_slots(trace_t *trace);
+static int refresh_handles(trace_t *trace, int tracenum, long opnum, 
+			   range_t **ranges, size_t *sizes);
+static void fit_slots(trace_t *trace, traceop_t *ops, int n);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -122,14 +292,75 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static void eval_mm_util(trace_t *trace, int tracenum, char *filename,
+			 stats_t *stats);
+static int snapshot_check(int tracenum, long opnum);
+static int eval_mm_shared(trace_t *trace, int tracenum);
+static int shared_coordinator(trace_t *trace, int tracenum, char *name);
+static int shared_worker(trace_t *trace, int tracenum, char *name, int w);
+static FILE *util_open(int tracenum, char *filename);
+static void util_sample(FILE *fp, long opnum, long total_size);
+static void heapmap_write(FILE **fp, int tracenum, char *filename, 
+			  long opnum, long total_size);
+static int parse_map_ops(char *list);
 static void eval_mm_speed(void *ptr);
+static void speed_setup(void *ptr);
+static inline void mm_request(trace_t *trace, traceop_t *op);
+static void eval_mm_latency(trace_t *trace, int tracenum, char *filename,
+			    stats_t *stats);
+static void lat_calibrate(double *ns_per_tick, unsigned long long *ovhd);
+static void lat_add(lathist_t *h, unsigned long long t);
+static unsigned long long lat_percentile(lathist_t *h, double pct);
+static void eval_mm_stream(char *tracedir, char *filename, int tracenum,
+			   stats_t *stats, range_t **ranges);
+static int stream_run(trace_t *trace, traceop_t *ops, int lo, int n,
+		      int tracenum, long base);
+static int stream_check(trace_t *trace, traceop_t *ops, int lo, int hi,
+			int tracenum, long base, range_t **ranges,
+			unsigned epoch, long *total_size, long *max_total_size);
+
+/* Runs the mm package over a whole set of tracefiles */
+static void run_mm(char **tracefiles, int num_tracefiles, 
+		   stats_t *mm_stats, range_t **ranges);
+static void eval_trace(char *filename, int tracenum, stats_t *stats,
+		       range_t **ranges);
+static void time_mm(speed_t *params, stats_t *stats);
+static void run_parallel(char **tracefiles, int num_tracefiles, 
+			 stats_t *mm_stats, range_t **ranges);
+static int pick_cpus(int *cpus, int max, int *num_cores);
+
+/* Threaded replay of traces with t, s and w requests (-T) */
+static void run_threaded(char **tracefiles, int num_tracefiles);
+static mtrace_t *split_trace(trace_t *trace, char *filename);
+static void free_mtrace(mtrace_t *mt);
+static double replay(mtrace_t *mt, int workers, replayer_t *r);
+static void *replay_thread(void *arg);
+static int parse_budgets(char *list, int *budgets, int max);
+static void sweep_budgets(char **tracefiles, int num_tracefiles, 
+			  int *budgets, int num_budgets, range_t **ranges);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void set_spread(stats_t *stats, ftimer_stats_t *st);
+static void count_events(void (*f)(void *), speed_t *params, stats_t *stats);
+static void printperf(int n, stats_t *stats);
+
+/* Results files (-o) and comparison with a baseline (-b) */
+static void write_results(char *path, char **tracefiles, int n, 
+			  stats_t *libc_stats, stats_t *mm_stats, 
+			  double perfindex);
+static void write_stats(FILE *fp, int csv, char *allocator, char *trace, 
+			stats_t *stats);
+static void json_string(FILE *fp, char *s);
+static int read_baseline(char *path, baseline_t **base);
+static char *json_value(char *p, char *key, char *val, int len);
+static int read_samples(char *p, double *t);
+static double sample_range(double *t, int n);
+static int compare_baseline(char *path, char **tracefiles, int n, 
+			    stats_t *mm_stats);
 static void usage(void);
 static void unix_error(char *msg);
-static void malloc_error(int tracenum, int opnum, char *msg);
+static void malloc_error(int tracenum, long opnum, char *msg);
 static void app_error(char *msg);
 
 /**************
@@ -138,18 +369,27 @@ static void app_error(char *msg);
 int main(int argc, char **argv)
 {
     int i;
-    char c;
+    int c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+    ftimer_stats_t st;         /* spread of the runs of a timing */
+    char *results = NULL;      /* file to write the results to (-o) */
+    char *baseline = NULL;     /* results to compare with (-b) */
+    int regressions = 0;
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int policy = MM_SIZE_ORDERED; /* Free-list ordering policy (-p) */
+    int budgets[MAXBUDGETS];      /* Fit budgets to sweep (-k) */
+    int num_budgets = 0;
+    int huge_pages = 0;  /* If set, back the heap with huge pages (-H) */
+    char *end;
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +398,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgalLPp:k:M:Hsj:T:w:c:o:b:u:m:S:A:R:")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +424,113 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'p': /* Free-list ordering policy of the mm package */
+            if (!strcmp(optarg, "size"))
+                policy = MM_SIZE_ORDERED;
+            else if (!strcmp(optarg, "addr"))
+                policy = MM_ADDR_ORDERED;
+            else {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'k': /* Sweep the good-fit search budget */
+            if ((num_budgets = parse_budgets(optarg, budgets, MAXBUDGETS)) == 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'M': /* Heap capacity in MB */
+            heap_mb = strtoul(optarg, &end, 10);
+            if ((*end != '\0') || (heap_mb == 0)) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'H': /* Back the heap with 2 MiB huge pages */
+            huge_pages = 1;
+            break;
+        case 'j': /* Evaluate traces in this many worker processes */
+            jobs = strtol(optarg, &end, 10);
+            if ((*end != '\0') || (jobs < 1) || (jobs > MAXJOBS)) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'T': /* Replay traces on up to this many threads */
+            max_threads = strtol(optarg, &end, 10);
+            if ((*end != '\0') || (max_threads < 1) || 
+		(max_threads > MAXTHREADS)) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'L': /* Report the latency of each request */
+            latency = 1;
+            break;
+        case 'u': /* Sample the heap's utilization every N requests */
+            util_every = strtol(optarg, &end, 10);
+            if ((*end != '\0') || (util_every < 1)) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'S': /* Check snapshot and restore every N requests */
+            snap_every = strtol(optarg, &end, 10);
+            if ((*end != '\0') || (snap_every < 1)) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'A': /* Replay each trace in N processes on a shared heap */
+            shared_procs = strtol(optarg, &end, 10);
+            if ((*end != '\0') || (shared_procs < 1)) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'R': /* Time each trace in N separate processes */
+            time_procs = strtol(optarg, &end, 10);
+            if ((*end != '\0') || (time_procs < 1) || 
+		(time_procs > MAXSAMPLES)) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'm': /* Take heap maps after these requests */
+            if (parse_map_ops(optarg) < 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'o': /* Write the results as JSON, or CSV for a .csv file */
+            results = optarg;
+            break;
+        case 'b': /* Compare the results with a baseline written by -o */
+            baseline = optarg;
+            break;
+        case 'P': /* Count hardware events per trace */
+            perf = 1;
+            break;
+        case 'w': /* Untimed warm-up runs before timing a trace */
+            i = strtol(optarg, &end, 10);
+            if ((*end != '\0') || (i < 0)) {
+                usage();
+                exit(1);
+            }
+            set_ftimer_warmup(i);
+            break;
+        case 'c': /* Time until the mean is known to within this percent */
+            secs = strtod(optarg, &end);
+            if ((*end != '\0') || (secs <= 0)) {
+                usage();
+                exit(1);
+            }
+            set_ftimer_ci(secs / 100);
+            break;
+        case 's': /* Stream each trace in a single pass */
+            streaming = 1;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -198,6 +545,16 @@ int main(int argc, char **argv)
             exit(1);
         }
     }
+
+    /* A streamed trace is only run once, and only through stream_run */
+    if (streaming && (latency || perf || util_every || num_map_ops || 
+		      map_every || snap_every || shared_procs || 
+		      time_procs > 1)) {
+	fprintf(stderr, "mdriver: -s cannot be used with -L, -P, -u, -m, "
+		"-S, -A or -R\n");
+	usage();
+	exit(1);
+    }
 	
     /* 
      * Check and print team info 
@@ -237,6 +594,17 @@ int main(int argc, char **argv)
 
     /* Initialize the timing package */
     init_fsecs();
+    if (perf) {
+	if (perf_init(verbose > 1) == 0) {
+	    printf("No performance counters can be opened here, -P ignored\n");
+	    perf = 0;
+	}
+	else {
+	    for (i = 0; i < PERF_EVENTS; i++)
+		if (!perf_available(i))
+		    printf("Counter %s not available\n", perf_name(i));
+	}
+    }
 
     /*
      * Optionally run and evaluate the libc malloc package 
@@ -261,7 +629,12 @@ int main(int argc, char **argv)
 		speed_params.trace = trace;
 		if (verbose > 1)
 		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		libc_stats[i].secs = fsecs_stats(eval_libc_speed, 
+						 &speed_params, &st);
+		set_spread(&libc_stats[i], &st);
+		if (perf)
+		    count_events(eval_libc_speed, &speed_params, 
+				 &libc_stats[i]);
 	    }
 	    free_trace(trace);
 	}
@@ -271,6 +644,10 @@ int main(int argc, char **argv)
 	    printf("\nResults for libc malloc:\n");
 	    printresults(num_tracefiles, libc_stats);
 	}
+	if (perf) {
+	    printf("\nEvents per request for libc malloc:\n");
+	    printperf(num_tracefiles, libc_stats);
+	}
     }
 
     /*
@@ -285,34 +662,51 @@ int main(int argc, char **argv)
 	unix_error("mm_stats calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
+    mem_set_max_heap(heap_mb << 20);
+    mem_set_huge_pages(huge_pages);
     mem_init(); 
+    mm_set_policy(policy);
+    if (verbose > 1)
+	printf("Using %s-ordered free lists\n",
+	       (policy == MM_ADDR_ORDERED) ? "address" : "size");
+    if (huge_pages && (verbose || (mem_huge_pages() == MEM_PAGES_SMALL)))
+	printf("Heap backed by %s\n",
+	       (mem_huge_pages() == MEM_PAGES_HUGETLB) ? "hugetlbfs pages" :
+	       (mem_huge_pages() == MEM_PAGES_THP) ? "transparent huge pages" :
+	       "ordinary pages (no huge pages available)");
 
-    /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
+    /* 
+     * With -k, report the util/throughput frontier over the requested
+     * fit budgets instead of a single performance index
+     */
+    if (num_budgets > 0) {
+	if (policy == MM_SIZE_ORDERED)
+	    printf("Note: size-ordered lists always take the tightest fit "
+		   "in a class; -k only changes -p addr\n");
+	sweep_budgets(tracefiles, num_tracefiles, budgets, num_budgets, 
+		      &ranges);
+	exit(errors ? 1 : 0);
     }
 
+    /* Evaluate student's mm malloc package using the K-best scheme */
+    run_mm(tracefiles, num_tracefiles, mm_stats, &ranges);
+
     /* Display the mm results in a compact table */
     if (verbose) {
-	printf("\nResults for mm malloc:\n");
+	printf("\nResults for mm malloc (%s-ordered free lists):\n",
+	       (policy == MM_ADDR_ORDERED) ? "address" : "size");
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (perf) {
+	printf("Events per request for mm malloc:\n");
+	printperf(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+
+    /* With -T, replay the traces on 1..N threads for scaling curves */
+    if (max_threads > 0)
+	run_threaded(tracefiles, num_tracefiles);
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -362,27 +756,36 @@ int main(int argc, char **argv)
 	printf("perfidx:%.0f\n", perfindex);
     }
 
-    exit(0);
+    if (results)
+	write_results(results, tracefiles, num_tracefiles, libc_stats, 
+		      mm_stats, perfindex);
+    if (baseline)
+	regressions = compare_baseline(baseline, tracefiles, num_tracefiles, 
+				       mm_stats);
+
+    exit(regressions ? 2 : 0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
-		     int tracenum, int opnum)
+		     int tracenum, long opnum)
 {
+    static unsigned int seed = 2463534242u;
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *pred = NULL, *succ = NULL;
+    range_t *l, *r;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -404,27 +807,44 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads. Since the stored
+     * payloads are disjoint, only its neighbours in address order, the 
+     * last one starting at or below lo and the first one above it, can.
+     */
+    for (p = *ranges;  p != NULL; ) {
+	if (p->lo <= lo) {
+	    pred = p;
+	    p = p->right;
+	}
+	else {
+	    succ = p;
+	    p = p->left;
+	}
+    }
+    if (((p = pred) != NULL && pred->hi >= lo) ||
+	((p = succ) != NULL && succ->lo <= hi)) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    seed ^= seed << 13;   /* xorshift32 */
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    p->prio = seed;
+    p->left = p->right = NULL;
+    split_ranges(*ranges, lo, &l, &r);
+    *ranges = merge_ranges(merge_ranges(l, p), r);
     return 1;
 }
 
@@ -433,19 +853,12 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    int size;
+    range_t *l, *mid, *r;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    split_ranges(*ranges, lo, &l, &r);
+    split_ranges(r, lo + 1, &mid, &r);
+    free(mid);    /* the record for lo, if there was one */
+    *ranges = merge_ranges(l, r);
 }
 
 /*
@@ -453,14 +866,59 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    if (*ranges == NULL)
+	return;
+    clear_ranges(&(*ranges)->left);
+    clear_ranges(&(*ranges)->right);
+    free(*ranges);
+    *ranges = NULL;
+}
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+/*
+ * split_ranges - Split tree t into the ranges starting below lo (*l)
+ *     and the ones starting at or above it (*r)
+ */
+static void split_ranges(range_t *t, char *lo, range_t **l, range_t **r)
+{
+    if (t == NULL)
+	*l = *r = NULL;
+    else if (t->lo < lo) {
+	split_ranges(t->right, lo, &t->right, r);
+	*l = t;
+    }
+    else {
+	split_ranges(t->left, lo, l, &t->left);
+	*r = t;
     }
-    *ranges = NULL;
+}
+
+/*
+ * merge_ranges - Join two trees where every range in l starts below
+ *     every range in r
+ */
+static range_t *merge_ranges(range_t *l, range_t *r)
+{
+    if (l == NULL)
+	return r;
+    if (r == NULL)
+	return l;
+    if (l->prio > r->prio) {
+	l->right = merge_ranges(l->right, r);
+	return l;
+    }
+    r->left = merge_ranges(l, r->left);
+    return r;
+}
+
+/*
+ * check_fill - Return 1 if the n bytes at p all hold the low byte of c.
+ *     Comparing the block with itself shifted by one byte checks it
+ *     with a single memcmp.
+ */
+static int check_fill(const char *p, int n, int c)
+{
+    return (n <= 0) ||
+	(((unsigned char)p[0] == (c & 0xFF)) && (memcmp(p, p + 1, n - 1) == 0));
 }
 
 
@@ -469,41 +927,33 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory. A text trace
+ *     is parsed into an array of requests; a binary one is mapped and
+ *     its requests are decoded as they are replayed. See tracefmt.c
+ *     for both formats.
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
-    FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
-    unsigned max_index = 0;
-    unsigned op_index;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
 
     /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+    if ((trace = (trace_t *) calloc(1, sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
 	
-    /* Read the trace file header */
+    /* Read the trace file header and its requests */
     strcpy(path, tracedir);
     strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
-	sprintf(msg, "Could not open %s in read_trace", path);
-	unix_error(msg);
-    }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
-    
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
+    if (trace_open(path, &trace->file) < 0)
+	exit(1);
+    trace->sugg_heapsize = trace->file.hdr.sugg_heapsize; /* not used */
+    trace->num_ids = trace->file.hdr.num_ids;
+    trace->num_ops = trace->file.hdr.num_ops;
+    trace->weight = trace->file.hdr.weight;                /* not used */
+    trace->num_regions = trace->file.hdr.num_regions;
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = 
@@ -514,58 +964,150 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace->block_sizes = 
 	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
 	unix_error("malloc 4 failed in read_trace");
-    
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-	switch(type[0]) {
-	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'r':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = REALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'f':
-	    fscanf(tracefile, "%ud", &index);
-	    trace->ops[op_index].type = FREE;
-	    trace->ops[op_index].index = index;
-	    break;
-	default:
-	    printf("Bogus type character (%c) in tracefile %s\n", 
-		   type[0], path);
-	    exit(1);
-	}
-	op_index++;
-	
-    }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
+
+    /* ... and the handle of each block allocated with mm_halloc */
+    if ((trace->handles = 
+	 (int *)malloc(trace->num_ids * sizeof(int))) == NULL)
+	unix_error("malloc 5 failed in read_trace");
+
+    /* Regions are numbered separately from blocks */
+    if ((trace->regions = (mm_region_t **)
+	 malloc((trace->num_regions + 1) * sizeof(mm_region_t *))) == NULL)
+	unix_error("malloc 6 failed in read_trace");
+    if ((trace->region_heads = 
+	 (int *)malloc((trace->num_regions + 1) * sizeof(int))) == NULL)
+	unix_error("malloc 7 failed in read_trace");
+    if ((trace->region_next = 
+	 (int *)malloc(trace->num_ids * sizeof(int))) == NULL)
+	unix_error("malloc 8 failed in read_trace");
     
     return trace;
 }
 
 /*
- * free_trace - Free the trace record and the three arrays it points
+ * free_trace - Free the trace record and the arrays it points
  *              to, all of which were allocated in read_trace().
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);      
+    trace_close(&trace->file); /* unmap or free the requests... */
+    free(trace->blocks);      /* ... and the arrays */
     free(trace->block_sizes);
+    free(trace->handles);
+    free(trace->regions);
+    free(trace->region_heads);
+    free(trace->region_next);
+    free(trace->live);
+    free(trace->filled);
+    free(trace->epoch);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * reset_slots - Mark every block of the trace as not handle-allocated
+ *     and every region as empty
+ */
+static void reset_slots(trace_t *trace)
+{
+    int i;
+
+    for (i = 0; i < trace->num_ids; i++)
+	trace->handles[i] = -1;
+    for (i = 0; i < trace->num_regions; i++)
+	trace->region_heads[i] = -1;
+}
+
+/*
+ * fit_slots - Make the slot tables of a streamed trace big enough for
+ *     every id and region in the n ops at ops. They start empty and at
+ *     least double each time they grow.
+ */
+static void fit_slots(trace_t *trace, traceop_t *ops, int n)
+{
+    int i, k, old;
+    int max_index = -1, max_region = -1;
+
+    for (k = 0; k < n; k++) {
+	if (TRACE_HAS_INDEX(ops[k].type) && ops[k].index > max_index)
+	    max_index = ops[k].index;
+	if (TRACE_HAS_REGION(ops[k].type) && ops[k].region > max_region)
+	    max_region = ops[k].region;
+    }
+
+    if (max_index >= trace->num_ids) {
+	old = trace->num_ids;
+	trace->num_ids = (max_index + 1 > 2 * old) ? max_index + 1 : 2 * old;
+	if ((trace->blocks = (char **)realloc(trace->blocks,
+		 trace->num_ids * sizeof(char *))) == NULL ||
+	    (trace->block_sizes = (size_t *)realloc(trace->block_sizes,
+		 trace->num_ids * sizeof(size_t))) == NULL ||
+	    (trace->handles = (int *)realloc(trace->handles,
+		 trace->num_ids * sizeof(int))) == NULL ||
+	    (trace->region_next = (int *)realloc(trace->region_next,
+		 trace->num_ids * sizeof(int))) == NULL ||
+	    (trace->live = (char **)realloc(trace->live,
+		 trace->num_ids * sizeof(char *))) == NULL ||
+	    (trace->filled = (size_t *)realloc(trace->filled,
+		 trace->num_ids * sizeof(size_t))) == NULL ||
+	    (trace->epoch = (unsigned *)realloc(trace->epoch,
+		 trace->num_ids * sizeof(unsigned))) == NULL)
+	    unix_error("realloc failed in fit_slots");
+	for (i = old; i < trace->num_ids; i++) {
+	    trace->blocks[i] = trace->live[i] = NULL;
+	    trace->block_sizes[i] = trace->filled[i] = 0;
+	    trace->handles[i] = -1;
+	    trace->epoch[i] = 0;
+	}
+    }
+
+    if (max_region >= trace->num_regions) {
+	old = trace->num_regions;
+	trace->num_regions = (max_region + 1 > 2 * old) ? 
+	    max_region + 1 : 2 * old;
+	if ((trace->regions = (mm_region_t **)realloc(trace->regions,
+		 trace->num_regions * sizeof(mm_region_t *))) == NULL ||
+	    (trace->region_heads = (int *)realloc(trace->region_heads,
+		 trace->num_regions * sizeof(int))) == NULL)
+	    unix_error("realloc failed in fit_slots");
+	for (i = old; i < trace->num_regions; i++)
+	    trace->region_heads[i] = -1;
+    }
+}
+
+/*
+ * refresh_handles - After mm_compact, look up where each live handle
+ *     object now lives, check that it is still well placed and that the
+ *     first sizes[i] bytes of its contents survived the move. Old ranges
+ *     are all removed before new ones are added, since an object may have
+ *     slid over the old spot of another one.
+ */
+static int refresh_handles(trace_t *trace, int tracenum, long opnum, 
+			   range_t **ranges, size_t *sizes)
+{
+    int i;
+    char *p;
+
+    for (i = 0; i < trace->num_ids; i++)
+	if (trace->handles[i] >= 0)
+	    remove_range(ranges, trace->blocks[i]);
+
+    for (i = 0; i < trace->num_ids; i++) {
+	if (trace->handles[i] < 0)
+	    continue;
+	p = mm_hlock(trace->handles[i]);
+	mm_hunlock(trace->handles[i]);
+	if (add_range(ranges, p, trace->block_sizes[i], tracenum, opnum) == 0)
+	    return 0;
+	if (!check_fill(p, sizes[i], i)) {
+	    malloc_error(tracenum, opnum, "mm_compact did not preserve "
+			 "the data of a moved object");
+	    return 0;
+	}
+	trace->blocks[i] = p;
+    }
+    return 1;
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -576,7 +1118,10 @@ void free_trace(trace_t *trace)
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
+    tracecur_t cur;
+    traceop_t op;
     int i, j;
+    int h, r;
     int index;
     int size;
     int oldsize;
@@ -587,6 +1132,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     /* Reset the heap and free any records in the range list */
     mem_reset_brk();
     clear_ranges(ranges);
+    reset_slots(trace);
 
     /* Call the mm package's init function */
     if (mm_init() < 0) {
@@ -595,11 +1141,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     }
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+    trace_start(&cur, &trace->file);
+    for (i = 0;  trace_next(&cur, &op);  i++) {
+	index = op.index;
+	size = op.size;
 
-        switch (trace->ops[i].type) {
+        switch (op.type) {
 
         case ALLOC: /* mm_malloc */
 
@@ -629,8 +1176,32 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->block_sizes[index] = size;
 	    break;
 
+        case HALLOC: /* mm_halloc */
+
+	    /* Allocate a relocatable object and pin it while we fill it */
+	    if ((h = mm_halloc(size)) < 0) {
+		malloc_error(tracenum, i, "mm_halloc failed.");
+		return 0;
+	    }
+	    p = mm_hlock(h);
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+	    mm_hunlock(h);
+
+	    /* Remember region and handle */
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    trace->handles[index] = h;
+	    break;
+
         case REALLOC: /* mm_realloc */
 	    
+	    if (trace->handles[index] >= 0) {
+		malloc_error(tracenum, i, "realloc of a handle object");
+		return 0;
+	    }
+
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
 	    if ((newp = mm_realloc(oldp, size)) == NULL) {
@@ -652,12 +1223,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     */
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
-	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	    if (!check_fill(newp, oldsize, index)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
-	      }
 	    }
 	    memset(newp, index & 0xFF, size);
 
@@ -671,54 +1240,301 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remove region from list and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    if (trace->handles[index] >= 0) {
+		mm_hfree(trace->handles[index]);
+		trace->handles[index] = -1;
+	    }
+	    else
+		mm_free(p);
+	    break;
+
+        case COMPACT: /* mm_compact */
+	    mm_compact();
+	    if (refresh_handles(trace, tracenum, i, ranges, 
+				trace->block_sizes) == 0)
+		return 0;
+	    break;
+
+        case RCREATE: /* mm_region_create */
+	    r = op.region;
+	    if ((trace->regions[r] = mm_region_create()) == NULL) {
+		malloc_error(tracenum, i, "mm_region_create failed.");
+		return 0;
+	    }
+	    trace->region_heads[r] = -1;
+	    break;
+
+        case RALLOC: /* mm_region_alloc */
+	    r = op.region;
+	    if ((p = mm_region_alloc(trace->regions[r], size)) == NULL) {
+		malloc_error(tracenum, i, "mm_region_alloc failed.");
+		return 0;
+	    }
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+
+	    /* Remember region and chain the block onto its region */
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    trace->region_next[index] = trace->region_heads[r];
+	    trace->region_heads[r] = index;
+	    break;
+
+        case RDESTROY: /* mm_region_destroy */
+	    r = op.region;
+	    for (j = trace->region_heads[r]; j >= 0; j = trace->region_next[j])
+		remove_range(ranges, trace->blocks[j]);
+	    trace->region_heads[r] = -1;
+	    mm_region_destroy(trace->regions[r]);
 	    break;
 
+        case THREAD: /* these only order the threads of a trace (-T) */
+        case POST:
+        case WAIT:
+            break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	if (snap_every && ((i + 1) % snap_every == 0) &&
+	    !snapshot_check(tracenum, i))
+	    return 0;
     }
 
     /* As far as we know, this is a valid malloc package */
     return 1;
 }
 
+/*
+ * snapshot_check - Save the heap with mm_snapshot, scribble over it and
+ *     bring it back with mm_restore (-S). The heap must come back byte
+ *     for byte at the same base, so every block the trace holds is still
+ *     valid; the rest of the trace then checks that the allocator runs
+ *     on from the restored image.
+ */
+static int snapshot_check(int tracenum, long opnum)
+{
+    char path[MAXLINE], *copy, *lo = mem_heap_lo();
+    size_t size = mem_heapsize();
+    int ok;
+
+    snprintf(path, sizeof(path), "%s/mdriver-%d.snap", P_tmpdir, 
+	     (int)getpid());
+    if ((copy = malloc(size)) == NULL)
+	unix_error("malloc failed in snapshot_check");
+    memcpy(copy, lo, size);
+    if (mm_snapshot(path) < 0) {
+	malloc_error(tracenum, opnum, "mm_snapshot failed.");
+	free(copy);
+	return 0;
+    }
+    memset(lo, 0xa5, size);
+    mem_reset_brk();
+
+    if (!(ok = (mm_restore(path) == 0)))
+	malloc_error(tracenum, opnum, "mm_restore failed.");
+    else if (!(ok = (mem_heap_lo() == lo) && (mem_heapsize() == size) &&
+		    (memcmp(lo, copy, size) == 0)))
+	malloc_error(tracenum, opnum, "mm_restore did not bring back "
+		     "the heap mm_snapshot saved.");
+    unlink(path);
+    free(copy);
+    return ok;
+}
+
+/*
+ * eval_mm_shared - Replay the trace in shared_procs processes at once on
+ *     one shared heap (-A). A coordinator process creates the heap and
+ *     runs mm_init; each worker maps the heap again by name and joins
+ *     it with mm_attach. A worker fills its blocks with its own byte and
+ *     checks it at every realloc and free, which catches a block given
+ *     to two processes or lost from the shared lists. Returns 1 if every
+ *     worker ran the trace through cleanly.
+ */
+static int eval_mm_shared(trace_t *trace, int tracenum)
+{
+    char name[MAXLINE];
+    pid_t pid;
+    int status, ok;
+
+    snprintf(name, sizeof(name), "/mdriver-%d-%d", (int)getpid(), tracenum);
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+	unix_error("fork failed in eval_mm_shared");
+    if (pid == 0)
+	_exit(shared_coordinator(trace, tracenum, name));
+    ok = (waitpid(pid, &status, 0) == pid) && WIFEXITED(status) &&
+	(WEXITSTATUS(status) == 0);
+    shm_unlink(name);
+    if (!ok)
+	malloc_error(tracenum, 0, "the shared heap check failed.");
+    return ok;
+}
+
+/*
+ * shared_coordinator - Create the shared heap for eval_mm_shared, run
+ *     its workers and wait for them. Returns the exit status.
+ */
+static int shared_coordinator(trace_t *trace, int tracenum, char *name)
+{
+    pid_t pid;
+    int w, status, failed = 0;
+
+    /* Room for every worker's blocks */
+    mem_set_max_heap(shared_procs * (heap_mb << 20));
+    if ((mem_init_shared(name) != 1) || (mm_init() < 0)) {
+	printf("ERROR [trace %d]: could not set up shared heap %s\n",
+	       tracenum, name);
+	return 1;
+    }
+    for (w = 0; w < shared_procs; w++) {
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+	    unix_error("fork failed in shared_coordinator");
+	if (pid == 0)
+	    _exit(shared_worker(trace, tracenum, name, w));
+    }
+    for (w = 0; w < shared_procs; w++)
+	if ((wait(&status) < 0) || !WIFEXITED(status) || 
+	    (WEXITSTATUS(status) != 0))
+	    failed++;
+    mem_deinit();
+    return failed > 0;
+}
+
+/*
+ * shared_worker - Worker w of eval_mm_shared. It replays the mallocs,
+ *     reallocs and frees of the trace, with a fill byte that differs
+ *     from the other workers'. Returns the exit status.
+ */
+static int shared_worker(trace_t *trace, int tracenum, char *name, int w)
+{
+    tracecur_t cur;
+    traceop_t op;
+    char *p, *newp;
+    int i, c, oldsize;
+
+    mem_deinit();
+    if ((mem_init_shared(name) != 0) || (mm_attach() < 0)) {
+	printf("ERROR [trace %d]: process %d could not attach to %s\n",
+	       tracenum, w, name);
+	fflush(stdout);
+	return 1;
+    }
+    memset(trace->blocks, 0, trace->num_ids * sizeof(char *));
+
+    trace_start(&cur, &trace->file);
+    for (i = 0; trace_next(&cur, &op); i++) {
+	c = op.index * shared_procs + w;
+	p = trace->blocks[op.index];
+	switch (op.type) {
+	case ALLOC:
+	    if ((p = mm_malloc(op.size)) == NULL ||
+		(p < (char *)mem_heap_lo()) || !IS_ALIGNED(p)) {
+		malloc_error(tracenum, i, "mm_malloc failed on the shared heap.");
+		break;
+	    }
+	    memset(p, c & 0xFF, op.size);
+	    trace->blocks[op.index] = p;
+	    trace->block_sizes[op.index] = op.size;
+	    continue;
+
+	case REALLOC:
+	    if (p == NULL)
+		continue;
+	    if ((newp = mm_realloc(p, op.size)) == NULL) {
+		malloc_error(tracenum, i, "mm_realloc failed on the shared heap.");
+		break;
+	    }
+	    oldsize = trace->block_sizes[op.index];
+	    if (op.size < oldsize)
+		oldsize = op.size;
+	    if (!check_fill(newp, oldsize, c)) {
+		malloc_error(tracenum, i, "a block changed on the shared heap.");
+		break;
+	    }
+	    memset(newp, c & 0xFF, op.size);
+	    trace->blocks[op.index] = newp;
+	    trace->block_sizes[op.index] = op.size;
+	    continue;
+
+	case FREE:
+	    if (p == NULL)
+		continue;
+	    if (!check_fill(p, trace->block_sizes[op.index], c)) {
+		malloc_error(tracenum, i, "a block changed on the shared heap.");
+		break;
+	    }
+	    mm_free(p);
+	    trace->blocks[op.index] = NULL;
+	    continue;
+
+	default:   /* handles, regions and compaction are left out */
+	    continue;
+	}
+	fflush(stdout);
+	return 1;
+    }
+    return 0;
+}
+
 /* 
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
- *   
+ *   peak size of the heap in bytes while running the student's malloc 
+ *   package on the trace. mm_compact may give memory back with a 
+ *   negative mem_sbrk, so we use the peak rather than the final brk.
+ *   Payloads are written as a program would write them, so the
+ *   resident set counts the pages the trace really uses. The payload
+ *   over the heap size is also averaged over the requests, which shows
+ *   how the heap is used all along rather than at its peak, and with
+ *   -u the heap is sampled every util_every requests.
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static void eval_mm_util(trace_t *trace, int tracenum, char *filename,
+			 stats_t *stats)
 {   
+    tracecur_t cur;
+    traceop_t op;
     int i;
     int index;
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    int h, r, j;
+    size_t heapsize;
     char *p;
     char *newp, *oldp;
+    double util_sum = 0;  /* payload over heap size, summed over requests */
+    FILE *fp = NULL;
+    FILE *map_fp = NULL;  /* heap maps (-m) */
+    int next_map = 0;     /* next of map_ops to take */
 
-    /* initialize the heap and the mm malloc package */
+    /* initialize the heap and the mm malloc package, starting with no
+     * resident pages so the trace pays only for the pages it touches */
     mem_reset_brk();
+    mem_reset_rss();
+    reset_slots(trace);
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
+    if (util_every)
+	fp = util_open(tracenum, filename);
+    memset(&compactions, 0, sizeof(compactions));
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    trace_start(&cur, &trace->file);
+    for (i = 0;  trace_next(&cur, &op);  i++) {
+        switch (op.type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op.index;
+	    size = op.size;
 
 	    if ((p = mm_malloc(size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
+	    memset(p, 0, size);
 	    
 	    /* Remember region and size */
 	    trace->blocks[index] = p;
@@ -733,14 +1549,33 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 		total_size : max_total_size;
 	    break;
 
+        case HALLOC: /* mm_halloc */
+	    index = op.index;
+	    size = op.size;
+
+	    if ((h = mm_halloc(size)) < 0)
+		app_error("mm_halloc failed in eval_mm_util");
+	    memset(mm_hlock(h), 0, size);
+	    mm_hunlock(h);
+
+	    /* Remember size and handle */
+	    trace->block_sizes[index] = size;
+	    trace->handles[index] = h;
+
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op.index;
+	    newsize = op.size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
 	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
+	    memset(newp, 0, newsize);
 
 	    /* Remember region and size */
 	    trace->blocks[index] = newp;
@@ -756,11 +1591,16 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
+	    index = op.index;
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
-	    mm_free(p);
+	    if (trace->handles[index] >= 0) {
+		mm_hfree(trace->handles[index]);
+		trace->handles[index] = -1;
+	    }
+	    else
+		mm_free(p);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -768,61 +1608,712 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+        case RCREATE: /* mm_region_create */
+	    r = op.region;
+	    if ((trace->regions[r] = mm_region_create()) == NULL)
+		app_error("mm_region_create failed in eval_mm_util");
+	    trace->region_heads[r] = -1;
+	    break;
+
+        case RALLOC: /* mm_region_alloc */
+	    r = op.region;
+	    index = op.index;
+	    size = op.size;
+	    if ((p = mm_region_alloc(trace->regions[r], size)) == NULL)
+		app_error("mm_region_alloc failed in eval_mm_util");
+	    memset(p, 0, size);
+	    trace->block_sizes[index] = size;
+	    trace->region_next[index] = trace->region_heads[r];
+	    trace->region_heads[r] = index;
+
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case RDESTROY: /* mm_region_destroy */
+	    r = op.region;
+	    for (j = trace->region_heads[r]; j >= 0; j = trace->region_next[j])
+		total_size -= trace->block_sizes[j];
+	    trace->region_heads[r] = -1;
+	    mm_region_destroy(trace->regions[r]);
+	    break;
+
+        case THREAD: /* these only order the threads of a trace (-T) */
+        case POST:
+        case WAIT:
+            break;
+
+        case COMPACT: /* mm_compact */
+	    heapsize = mem_heapsize();
+	    if (compactions.count++ == 0) {
+		compactions.first = heapsize;
+		compactions.util_first = heapsize ? 
+		    (double)total_size / heapsize : 0;
+	    }
+	    mm_compact();
+	    heapsize = mem_heapsize();
+	    compactions.last = heapsize;
+	    compactions.util_last = heapsize ? 
+		(double)total_size / heapsize : 0;
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+	if ((heapsize = mem_heapsize()) > 0)
+	    util_sum += (double)total_size / heapsize;
+	if (fp && ((i + 1) % util_every == 0))
+	    util_sample(fp, i + 1, total_size);
+	while ((next_map < num_map_ops) && (map_ops[next_map] < i + 1))
+	    next_map++;
+	if (((next_map < num_map_ops) && (map_ops[next_map] == i + 1)) ||
+	    (map_every && ((i + 1) % map_every == 0)))
+	    heapmap_write(&map_fp, tracenum, filename, i + 1, total_size);
     }
-
-    return ((double)max_total_size / (double)mem_heapsize());
+    if (map_fp)
+	fclose(map_fp);
+
+    stats->util_tw = i ? util_sum / i : 0;
+    if (fp) {
+	if (i % util_every)
+	    util_sample(fp, i, total_size);
+	fclose(fp);
+	printf("trace %d (%s): utilization %.1f%% at peak, %.1f%% averaged "
+	       "over the requests\n", tracenum, filename, 
+	       100.0 * max_total_size / mem_peak_heapsize(), 
+	       100.0 * stats->util_tw);
+    }
+    stats->util = (double)max_total_size / (double)mem_peak_heapsize();
+    stats->rss = (double)mem_peak_rss();
+    stats->rss_util = stats->rss ? (double)max_total_size / stats->rss : 0;
 }
 
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * util_open - Create the file that a trace's utilization samples go to
+ *     (-u), util-<tracenum>-<name>.csv in the current directory, and 
+ *     write its header
+ */
+static FILE *util_open(int tracenum, char *filename)
+{
+    char path[MAXLINE], *base;
+    FILE *fp;
+    int i;
+
+    base = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+    snprintf(path, sizeof(path), "util-%d-%s.csv", tracenum, base);
+    if ((fp = fopen(path, "w")) == NULL)
+	unix_error("Could not create a utilization samples file");
+    fprintf(fp, "op,payload,heap,util,free,largest_free,frag");
+    for (i = 0; i < MM_CLASSES; i++)
+	fprintf(fp, ",free_%lu%s", 1UL << i, (i == MM_CLASSES - 1) ? "+" : "");
+    fprintf(fp, "\n");
+    return fp;
+}
+
+/*
+ * util_sample - Write a sample of the heap after request opnum: the live
+ *     payload, heap size, free bytes in all and in each class, and the
+ *     largest free block. frag is the share of the free bytes outside the
+ *     largest free block, 0 when it could satisfy any request they could.
+ */
+static void util_sample(FILE *fp, long opnum, long total_size)
+{
+    size_t bytes[MM_CLASSES], heapsize, free_bytes = 0, largest;
+    int i;
+
+    heapsize = mem_heapsize();
+    largest = mm_free_space(bytes);
+    for (i = 0; i < MM_CLASSES; i++)
+	free_bytes += bytes[i];
+    fprintf(fp, "%ld,%ld,%zu,%.4f,%zu,%zu,%.4f", opnum, total_size, heapsize,
+	    heapsize ? (double)total_size / heapsize : 0.0, free_bytes, largest,
+	    free_bytes ? 1 - (double)largest / free_bytes : 0.0);
+    for (i = 0; i < MM_CLASSES; i++)
+	fprintf(fp, ",%zu", bytes[i]);
+    fprintf(fp, "\n");
+}
+
+/*
+ * heapmap_write - Append a map of the heap after request opnum to the
+ *     trace's heap map file (-m), heapmap-<tracenum>-<name>.map in the
+ *     current directory, creating it first if *fp is NULL
+ */
+static void heapmap_write(FILE **fp, int tracenum, char *filename, 
+			  long opnum, long total_size)
+{
+    static mm_block_t *blocks = NULL;
+    static long max = 0;
+    heapmap_hdr_t hdr;
+    char path[MAXLINE], *base;
+    long n;
+
+    /* The records are written straight from mm's array */
+    assert(sizeof(mm_block_t) == sizeof(heapmap_rec_t));
+
+    if (*fp == NULL) {
+	base = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+	snprintf(path, sizeof(path), "heapmap-%d-%s.map", tracenum, base);
+	if ((*fp = fopen(path, "w")) == NULL)
+	    unix_error("Could not create a heap map file");
+    }
+    while ((n = mm_heap_map(blocks, max)) > max) {
+	max = 2 * n;
+	if ((blocks = realloc(blocks, max * sizeof(mm_block_t))) == NULL)
+	    unix_error("realloc failed in heapmap_write");
+    }
+
+    hdr.magic = HEAPMAP_MAGIC;
+    hdr.version = HEAPMAP_VERSION;
+    hdr.op = opnum;
+    hdr.heapsize = mem_heapsize();
+    hdr.payload = total_size;
+    hdr.num_blocks = n;
+    if (fwrite(&hdr, sizeof(hdr), 1, *fp) != 1 ||
+	fwrite(blocks, sizeof(mm_block_t), n, *fp) != n)
+	unix_error("Could not write a heap map");
+}
+
+/*
+ * speed_setup - Reset the slot tables before each run of eval_mm_speed,
+ *     outside the time
+ */
+static void speed_setup(void *ptr)
+{
+    reset_slots(((speed_t *)ptr)->trace);
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
+    tracecur_t cur;
+    traceop_t op;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
-    /* Reset the heap and initialize the mm package */
+    /* Reset the heap and initialize the mm package; speed_setup has
+       reset the slot tables */
     mem_reset_brk();
     if (mm_init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    trace_start(&cur, &trace->file);
+    while (trace_next(&cur, &op))
+	mm_request(trace, &op);
+}
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-		app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
-            break;
+/*
+ * mm_request - Make one trace request of the mm package, unchecked
+ */
+static inline void mm_request(trace_t *trace, traceop_t *op)
+{
+    int index, size, newsize, r;
+    char *p, *newp, *oldp, *block;
+
+    switch (op->type) {
+
+    case ALLOC: /* mm_malloc */
+	index = op->index;
+	size = op->size;
+	if ((p = mm_malloc(size)) == NULL)
+	    app_error("mm_malloc error in eval_mm_speed");
+	trace->blocks[index] = p;
+	break;
+
+    case HALLOC: /* mm_halloc */
+	index = op->index;
+	size = op->size;
+	if ((trace->handles[index] = mm_halloc(size)) < 0)
+	    app_error("mm_halloc error in eval_mm_speed");
+	break;
+
+    case REALLOC: /* mm_realloc */
+	index = op->index;
+	newsize = op->size;
+	oldp = trace->blocks[index];
+	if ((newp = mm_realloc(oldp,newsize)) == NULL)
+	    app_error("mm_realloc error in eval_mm_speed");
+	trace->blocks[index] = newp;
+	break;
+
+    case FREE: /* mm_free */
+	index = op->index;
+	if (trace->handles[index] >= 0) {
+	    mm_hfree(trace->handles[index]);
+	    trace->handles[index] = -1;
+	    break;
+	}
+	block = trace->blocks[index];
+	mm_free(block);
+	break;
+
+    case COMPACT: /* mm_compact */
+	mm_compact();
+	break;
+
+    case RCREATE: /* mm_region_create */
+	r = op->region;
+	if ((trace->regions[r] = mm_region_create()) == NULL)
+	    app_error("mm_region_create error in eval_mm_speed");
+	break;
+
+    case RALLOC: /* mm_region_alloc */
+	r = op->region;
+	size = op->size;
+	if (mm_region_alloc(trace->regions[r], size) == NULL)
+	    app_error("mm_region_alloc error in eval_mm_speed");
+	break;
+
+    case RDESTROY: /* mm_region_destroy */
+	mm_region_destroy(trace->regions[op->region]);
+	break;
+
+    case THREAD: /* these only order the threads of a trace (-T) */
+    case POST:
+    case WAIT:
+	break;
+
+    default:
+	app_error("Nonexistent request type in eval_mm_valid");
+    }
+}
+
+/*
+ * eval_mm_latency - Time each request of a trace on its own (-L), after
+ *     fsecs has warmed up the caches, and report the latencies of each
+ *     kind of request. The ticks go into a buffer allocated up front so
+ *     the replay does nothing but call the mm package and read the clock;
+ *     the histograms are built afterwards. The clock's own overhead is
+ *     measured and taken off every request.
+ */
+static void eval_mm_latency(trace_t *trace, int tracenum, char *filename,
+			    stats_t *stats)
+{
+    static const char *kind_names[LAT_KINDS] = 
+	{"malloc", "realloc", "free", "other"};
+    static double ns_per_tick;
+    static unsigned long long ovhd;
+    tracecur_t cur;
+    traceop_t op;
+    unsigned *ticks;
+    unsigned long long t0, t1;
+    lathist_t *hist, all;
+    char buf[2048];
+    int i, k, len;
+
+    if (ns_per_tick == 0)
+	lat_calibrate(&ns_per_tick, &ovhd);
+    if ((ticks = malloc(trace->num_ops * sizeof(unsigned))) == NULL ||
+	(hist = calloc(LAT_KINDS, sizeof(lathist_t))) == NULL)
+	unix_error("malloc failed in eval_mm_latency");
+
+    /* Replay the trace, timing each request */
+    mem_reset_brk();
+    reset_slots(trace);
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_latency");
+    trace_start(&cur, &trace->file);
+    for (i = 0;  trace_next(&cur, &op);  i++) {
+	t0 = read_counter();
+	mm_request(trace, &op);
+	t1 = read_counter();
+	t1 = (t1 - t0 > ovhd) ? t1 - t0 - ovhd : 0;
+	ticks[i] = (t1 > UINT_MAX) ? UINT_MAX : t1;
+    }
+
+    /* Sort the latencies by kind of request */
+    memset(&all, 0, sizeof(all));
+    trace_start(&cur, &trace->file);
+    for (i = 0;  trace_next(&cur, &op);  i++) {
+	switch (op.type) {
+	case ALLOC: case HALLOC: case RALLOC: k = 0; break;
+	case REALLOC:                         k = 1; break;
+	case FREE:                            k = 2; break;
+	case THREAD: case POST: case WAIT:    continue;
+	default:                              k = 3; break;
+	}
+	lat_add(&hist[k], ticks[i]);
+	lat_add(&all, ticks[i]);
+    }
+    stats->lat_p50 = lat_percentile(&all, 50) * ns_per_tick;
+    stats->lat_p99 = lat_percentile(&all, 99) * ns_per_tick;
+    stats->lat_p999 = lat_percentile(&all, 99.9) * ns_per_tick;
+
+    /* Print the report in one piece, so -j workers don't interleave */
+    len = snprintf(buf, sizeof(buf), 
+		   "\nLatency (ns) of trace %d (%s), clock overhead %.0f ns "
+		   "removed:\n%8s%9s%8s%8s%8s%8s%8s%8s%9s\n", tracenum, filename,
+		   ovhd * ns_per_tick, "request", "count", "mean", "min", "p50",
+		   "p90", "p99", "p99.9", "max");
+    for (k = 0; k <= LAT_KINDS; k++) {
+	lathist_t *h = (k < LAT_KINDS) ? &hist[k] : &all;
+	if (h->count == 0)
+	    continue;
+	len += snprintf(buf + len, sizeof(buf) - len, 
+			"%8s%9ld%8.0f%8.0f%8.0f%8.0f%8.0f%8.0f%9.0f\n",
+			(k < LAT_KINDS) ? kind_names[k] : "all", h->count,
+			h->sum / h->count * ns_per_tick, h->min * ns_per_tick,
+			lat_percentile(h, 50) * ns_per_tick,
+			lat_percentile(h, 90) * ns_per_tick,
+			lat_percentile(h, 99) * ns_per_tick,
+			lat_percentile(h, 99.9) * ns_per_tick,
+			h->max * ns_per_tick);
+    }
+    fputs(buf, stdout);
+    fflush(stdout);
+    free(ticks);
+    free(hist);
+}
+
+/*
+ * lat_calibrate - Find the length of a tick against CLOCK_MONOTONIC, and
+ *     the fewest ticks two back to back reads of the clock take
+ */
+static void lat_calibrate(double *ns_per_tick, unsigned long long *ovhd)
+{
+    struct timespec ts0, ts1;
+    unsigned long long t0, t1, d;
+    double ns;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    t0 = read_counter();
+    do {
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	ns = (ts1.tv_sec - ts0.tv_sec) * 1e9 + (ts1.tv_nsec - ts0.tv_nsec);
+    } while (ns < 20e6);
+    t1 = read_counter();
+    *ns_per_tick = ns / (t1 - t0);
+
+    *ovhd = ~0ULL;
+    for (i = 0; i < 1000; i++) {
+	t0 = read_counter();
+	t1 = read_counter();
+	d = t1 - t0;
+	if (d < *ovhd)
+	    *ovhd = d;
+    }
+}
+
+/*
+ * lat_add - Count a latency of t ticks in histogram h
+ */
+static void lat_add(lathist_t *h, unsigned long long t)
+{
+    int e, b;
+
+    if (h->count == 0 || t < h->min)
+	h->min = t;
+    if (t > h->max)
+	h->max = t;
+    h->count++;
+    h->sum += t;
+    if (t < (1 << LAT_SUB_BITS))
+	b = t;
+    else {
+	e = 63 - __builtin_clzll(t);   /* t's highest set bit */
+	b = ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + 
+	    ((t >> (e - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+    }
+    h->buckets[b]++;
+}
+
+/*
+ * lat_percentile - Return the latency in ticks that pct percent of the
+ *     latencies in h are no greater than, as the top of its bucket
+ */
+static unsigned long long lat_percentile(lathist_t *h, double pct)
+{
+    long rank, seen = 0;
+    unsigned long long lo, width;
+    int b, e;
+
+    rank = (long)(pct / 100 * h->count);
+    if (rank < pct / 100 * h->count || rank < 1)
+	rank++;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+	if ((seen += h->buckets[b]) < rank)
+	    continue;
+	if (b < (1 << LAT_SUB_BITS))
+	    return b;
+	e = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+	width = 1ULL << (e - LAT_SUB_BITS);
+	lo = ((1ULL << LAT_SUB_BITS) + (b & ((1 << LAT_SUB_BITS) - 1))) * width;
+	return (lo + width - 1 < h->max) ? lo + width - 1 : h->max;
+    }
+    return h->max;
+}
+
+/*
+ * eval_mm_stream - Check the mm package, measure its utilization, and
+ *     time it in a single pass over a trace that is read from disk a
+ *     chunk at a time instead of being loaded (-s). The ops run in
+ *     stretches that end at a chunk boundary or a mm_compact. Each
+ *     stretch first runs through the mm package alone, timed, recording
+ *     what every request returned. Then, untimed, the results are checked
+ *     in order against the range tree, utilization is accounted, and the
+ *     blocks the stretch left allocated are checked and filled. So data
+ *     is checked to survive mm_realloc and mm_compact from one stretch to
+ *     the next. Blocks that die within a stretch are never written, so
+ *     the resident set is not measured.
+ */
+static void eval_mm_stream(char *tracedir, char *filename, int tracenum,
+			   stats_t *stats, range_t **ranges)
+{
+    trace_t *trace;
+    tracestream_t ts;
+    traceop_t *ops;
+    char path[MAXLINE];
+    double start;
+    long base = 0, total_size = 0, max_total_size = 0;
+    unsigned epoch = 0;
+    int n, lo, hi;
+
+    if (verbose > 1)
+	printf("Streaming tracefile: %s\n", filename);
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    if (trace_stream_open(path, &ts) < 0)
+	exit(1);
+    if ((trace = (trace_t *)calloc(1, sizeof(trace_t))) == NULL)
+	unix_error("calloc failed in eval_mm_stream");
+
+    mem_reset_brk();
+    clear_ranges(ranges);
+    stats->valid = 0;
+    stats->secs = 0;
+    stats->rss = stats->rss_util = 0;
+    if (mm_init() < 0) {
+	malloc_error(tracenum, 0, "mm_init failed.");
+	goto done;
+    }
+
+    while ((n = trace_stream_next(&ts, &ops)) > 0) {
+	fit_slots(trace, ops, n);
+	for (lo = 0; lo < n; lo = hi) {
+	    start = ftimer_now();
+	    hi = stream_run(trace, ops, lo, n, tracenum, base);
+	    stats->secs += ftimer_now() - start;
+	    if (hi < 0)
+		goto done;
+	    if (stream_check(trace, ops, lo, hi, tracenum, base, ranges, 
+			     ++epoch, &total_size, &max_total_size) == 0)
+		goto done;
+	}
+	base += n;
+    }
+    if (n < 0)
+	exit(1);
+
+    stats->valid = 1;
+    stats->util = (double)max_total_size / (double)mem_peak_heapsize();
+
+ done:
+    stats->ops = base;
+    trace_stream_close(&ts);
+    free_trace(trace);
+}
+
+/*
+ * stream_run - Run ops lo.. of the chunk through the mm package, up to
+ *     n or a mm_compact, and record in stream_res what each request
+ *     returned. A mm_compact runs alone, since it may shrink the heap
+ *     that the blocks before it are checked against. Returns where it
+ *     stopped, or -1 if the package failed a request.
+ */
+static int stream_run(trace_t *trace, traceop_t *ops, int lo, int n,
+		      int tracenum, long base)
+{
+    int k, index, h;
+    char *p;
+
+    for (k = lo; k < n; k++) {
+	index = ops[k].index;
+	switch (ops[k].type) {
+
+	case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(ops[k].size)) == NULL) {
+		malloc_error(tracenum, base + k, "mm_malloc failed.");
+		return -1;
+	    }
+	    trace->live[index] = stream_res[k] = p;
+	    break;
+
+	case HALLOC: /* mm_halloc */
+	    if ((h = mm_halloc(ops[k].size)) < 0) {
+		malloc_error(tracenum, base + k, "mm_halloc failed.");
+		return -1;
+	    }
+	    trace->handles[index] = h;
+	    stream_res[k] = mm_hlock(h);
+	    mm_hunlock(h);
+	    break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL)
-		app_error("mm_realloc error in eval_mm_speed");
-            trace->blocks[index] = newp;
-            break;
+	    if (trace->handles[index] >= 0) {
+		malloc_error(tracenum, base + k, "realloc of a handle object");
+		return -1;
+	    }
+	    if ((p = mm_realloc(trace->live[index], ops[k].size)) == NULL) {
+		malloc_error(tracenum, base + k, "mm_realloc failed.");
+		return -1;
+	    }
+	    trace->live[index] = stream_res[k] = p;
+	    break;
 
-        case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            block = trace->blocks[index];
-            mm_free(block);
-            break;
+	case FREE: /* mm_free */
+	    if (trace->handles[index] >= 0) {
+		mm_hfree(trace->handles[index]);
+		trace->handles[index] = -1;
+	    }
+	    else
+		mm_free(trace->live[index]);
+	    break;
+
+	case COMPACT: /* mm_compact, which is a stretch of its own */
+	    if (k > lo)
+		return k;
+	    mm_compact();
+	    return k + 1;
+
+	case RCREATE: /* mm_region_create */
+	    if ((trace->regions[ops[k].region] = mm_region_create()) == NULL) {
+		malloc_error(tracenum, base + k, "mm_region_create failed.");
+		return -1;
+	    }
+	    break;
+
+	case RALLOC: /* mm_region_alloc */
+	    if ((p = mm_region_alloc(trace->regions[ops[k].region], 
+				     ops[k].size)) == NULL) {
+		malloc_error(tracenum, base + k, "mm_region_alloc failed.");
+		return -1;
+	    }
+	    trace->live[index] = stream_res[k] = p;
+	    break;
+
+	case RDESTROY: /* mm_region_destroy */
+	    mm_region_destroy(trace->regions[ops[k].region]);
+	    break;
+
+	case THREAD: /* these only order the threads of a trace (-T) */
+	case POST:
+	case WAIT:
+	    break;
 
 	default:
-	    app_error("Nonexistent request type in eval_mm_valid");
-        }
+	    app_error("Nonexistent request type in stream_run");
+	}
+    }
+    return n;
+}
+
+/*
+ * stream_check - Check the results stream_run recorded for ops lo..hi-1
+ *     in order, as eval_mm_valid would have as they happened, and
+ *     account the payload they leave allocated. Then check that the
+ *     blocks the stretch touched kept the bytes they were filled with,
+ *     and fill them. Returns 0 if the mm package got anything wrong.
+ */
+static int stream_check(trace_t *trace, traceop_t *ops, int lo, int hi,
+			int tracenum, long base, range_t **ranges,
+			unsigned epoch, long *total_size, long *max_total_size)
+{
+    int k, j, t, r, index, size;
+    int num_touched = 0;
+    char *p;
+
+    for (k = lo; k < hi; k++) {
+	index = ops[k].index;
+	size = ops[k].size;
+	r = ops[k].region;
+	p = stream_res[k];
+
+	switch (ops[k].type) {
+
+	case ALLOC:
+	case HALLOC:
+	case RALLOC:
+	    if (add_range(ranges, p, size, tracenum, base + k) == 0)
+		return 0;
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    trace->filled[index] = 0;
+	    *total_size += size;
+	    if (ops[k].type == RALLOC) {
+		trace->region_next[index] = trace->region_heads[r];
+		trace->region_heads[r] = index;
+	    }
+	    break;
+
+	case REALLOC:
+	    remove_range(ranges, trace->blocks[index]);
+	    if (add_range(ranges, p, size, tracenum, base + k) == 0)
+		return 0;
+	    if (size < trace->filled[index])
+		trace->filled[index] = size;
+	    *total_size += size - trace->block_sizes[index];
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+	case FREE:
+	    remove_range(ranges, trace->blocks[index]);
+	    *total_size -= trace->block_sizes[index];
+	    trace->blocks[index] = NULL;
+	    break;
+
+	case COMPACT:
+	    if (refresh_handles(trace, tracenum, base + k, ranges,
+				trace->filled) == 0)
+		return 0;
+	    break;
+
+	case RCREATE:
+	    trace->region_heads[r] = -1;
+	    break;
+
+	case RDESTROY:
+	    for (j = trace->region_heads[r]; j >= 0; j = trace->region_next[j]) {
+		remove_range(ranges, trace->blocks[j]);
+		*total_size -= trace->block_sizes[j];
+		trace->blocks[j] = NULL;
+	    }
+	    trace->region_heads[r] = -1;
+	    break;
+
+	case THREAD: /* these only order the threads of a trace (-T) */
+	case POST:
+	case WAIT:
+	    break;
+	}
+
+	if (*total_size > *max_total_size)
+	    *max_total_size = *total_size;
+	if (TRACE_HAS_INDEX(ops[k].type) && trace->epoch[index] != epoch) {
+	    trace->epoch[index] = epoch;
+	    stream_touched[num_touched++] = index;
+	}
+    }
+
+    for (t = 0; t < num_touched; t++) {
+	index = stream_touched[t];
+	if ((p = trace->blocks[index]) == NULL)
+	    continue;
+	if (!check_fill(p, trace->filled[index], index)) {
+	    malloc_error(tracenum, base + hi - 1, "mm_realloc did not "
+			 "preserve the data from old block");
+	    return 0;
+	}
+	memset(p, index & 0xFF, trace->block_sizes[index]);
+	trace->filled[index] = trace->block_sizes[index];
+    }
+    return 1;
 }
 
 /*
@@ -833,34 +2324,68 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i, newsize;
+    tracecur_t cur;
+    traceop_t op;
+    int i, j, index, newsize;
     char *p, *newp, *oldp;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    trace_start(&cur, &trace->file);
+    for (i = 0;  trace_next(&cur, &op);  i++) {
+        switch (op.type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+        case HALLOC:
+	    if ((p = malloc(op.size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    trace->blocks[op.index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
+            newsize = op.size;
+	    oldp = trace->blocks[op.index];
 	    if ((newp = realloc(oldp, newsize)) == NULL) {
 		malloc_error(tracenum, i, "libc realloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	    trace->blocks[op.index] = newp;
 	    break;
 	    
         case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+	    free(trace->blocks[op.index]);
+	    break;
+
+        case COMPACT: /* libc has nothing to compact */
+	    break;
+
+        case RCREATE: /* regions are emulated with malloc and free */
+	    trace->region_heads[op.region] = -1;
 	    break;
 
+        case RALLOC:
+	    if ((p = malloc(op.size)) == NULL) {
+		malloc_error(tracenum, i, "libc malloc failed");
+		unix_error("System message");
+	    }
+	    index = op.index;
+	    trace->blocks[index] = p;
+	    trace->region_next[index] = trace->region_heads[op.region];
+	    trace->region_heads[op.region] = index;
+	    break;
+
+        case RDESTROY:
+	    for (j = trace->region_heads[op.region]; j >= 0; 
+		 j = trace->region_next[j])
+		free(trace->blocks[j]);
+	    trace->region_heads[op.region] = -1;
+	    break;
+
+        case THREAD: /* these only order the threads of a trace (-T) */
+        case POST:
+        case WAIT:
+            break;
+
 	default:
 	    app_error("invalid operation type  in eval_libc_valid");
 	}
@@ -876,24 +2401,28 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    tracecur_t cur;
+    traceop_t op;
+    int i, j, r;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    trace_start(&cur, &trace->file);
+    for (i = 0;  trace_next(&cur, &op);  i++) {
+        switch (op.type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+        case HALLOC:
+	    index = op.index;
+	    size = op.size;
 	    if ((p = malloc(size)) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
 	    break;
 
 	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
+	    index = op.index;
+	    newsize = op.size;
 	    oldp = trace->blocks[index];
 	    if ((newp = realloc(oldp, newsize)) == NULL)
 		unix_error("realloc failed in eval_libc_speed\n");
@@ -902,12 +2431,757 @@ static void eval_libc_speed(void *ptr)
 	    break;
 	    
         case FREE: /* free */
-	    index = trace->ops[i].index;
+	    index = op.index;
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
+
+        case COMPACT:
+	    break;
+
+        case RCREATE:
+	    trace->region_heads[op.region] = -1;
+	    break;
+
+        case RALLOC:
+	    index = op.index;
+	    r = op.region;
+	    if ((p = malloc(op.size)) == NULL)
+		unix_error("malloc failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    trace->region_next[index] = trace->region_heads[r];
+	    trace->region_heads[r] = index;
+	    break;
+
+        case RDESTROY:
+	    r = op.region;
+	    for (j = trace->region_heads[r]; j >= 0; j = trace->region_next[j])
+		free(trace->blocks[j]);
+	    trace->region_heads[r] = -1;
+	    break;
+
+        case THREAD: /* these only order the threads of a trace (-T) */
+        case POST:
+        case WAIT:
+            break;
+	}
+    }
+}
+
+/*
+ * run_mm - Evaluate the correctness, utilization, and speed of the mm
+ *     package on each tracefile, leaving the results in mm_stats
+ */
+static void run_mm(char **tracefiles, int num_tracefiles, 
+		   stats_t *mm_stats, range_t **ranges)
+{
+    int i;
+
+    if (jobs > 1) {
+	run_parallel(tracefiles, num_tracefiles, mm_stats, ranges);
+	return;
+    }
+    for (i=0; i < num_tracefiles; i++)
+	eval_trace(tracefiles[i], i, &mm_stats[i], ranges);
+}
+
+/*
+ * eval_trace - Evaluate the mm package on one tracefile
+ */
+static void eval_trace(char *filename, int tracenum, stats_t *stats,
+		       range_t **ranges)
+{
+    trace_t *trace;
+    speed_t speed_params;
+
+    if (streaming) {
+	eval_mm_stream(tracedir, filename, tracenum, stats, ranges);
+	return;
+    }
+    trace = read_trace(tracedir, filename);
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    stats->valid = eval_mm_valid(trace, tracenum, ranges);
+    if (stats->valid && shared_procs)
+	stats->valid = eval_mm_shared(trace, tracenum);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	eval_mm_util(trace, tracenum, filename, stats);
+	speed_params.trace = trace;
+	speed_params.ranges = *ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	if (verbose && compactions.count)
+	    printf("trace %d: %d compaction%s, heap %u bytes before the "
+		   "first and %u after the last, util %.0f%% -> %.0f%%\n", 
+		   tracenum, compactions.count, 
+		   (compactions.count == 1) ? "" : "s", 
+		   (unsigned)compactions.first, (unsigned)compactions.last, 
+		   100 * compactions.util_first, 100 * compactions.util_last);
+	time_mm(&speed_params, stats);
+	if (perf)
+	    count_events(eval_mm_speed, &speed_params, stats);
+	if (latency)
+	    eval_mm_latency(trace, tracenum, filename, stats);
+    }
+    free_trace(trace);
+}
+
+/*
+ * time_mm - Time the mm package on a trace, in this process or, with
+ *     -R, in time_procs forked processes one after another. Each one
+ *     warms up and times the trace afresh and sends its median back
+ *     through a pipe; secs is the median of those medians, and the
+ *     spread of the runs is the widest any process saw.
+ */
+static void time_mm(speed_t *params, stats_t *stats)
+{
+    struct {
+	double secs;
+	ftimer_stats_t st;
+    } r;
+    double t[MAXSAMPLES], x, min = 0, sd = 0, ci = 0;
+    int fds[2], p, i, status, runs = 0;
+    pid_t pid;
+
+    set_fsecs_setup(speed_setup);
+    if (time_procs == 1) {
+	stats->secs = fsecs_stats(eval_mm_speed, params, &r.st);
+	set_spread(stats, &r.st);
+	stats->samples[0] = stats->secs;
+	stats->num_samples = 1;
+	set_fsecs_setup(NULL);
+	return;
+    }
+
+    fflush(stdout);
+    for (p = 0; p < time_procs; p++) {
+	if (pipe(fds) < 0)
+	    unix_error("pipe failed in time_mm");
+	if ((pid = fork()) < 0)
+	    unix_error("fork failed in time_mm");
+	if (pid == 0) {
+	    close(fds[0]);
+	    r.secs = fsecs_stats(eval_mm_speed, params, &r.st);
+	    _exit(write(fds[1], &r, sizeof(r)) == sizeof(r) ? 0 : 1);
+	}
+	close(fds[1]);
+	i = read(fds[0], &r, sizeof(r));
+	close(fds[0]);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || 
+	    WEXITSTATUS(status) != 0 || i != sizeof(r))
+	    app_error("A timing process failed in time_mm");
+	set_spread(stats, &r.st);    /* reports each process under -V */
+	if (p == 0 || r.st.min < min)
+	    min = r.st.min;
+	if (r.st.stddev > sd)
+	    sd = r.st.stddev;
+	if (r.st.ci > ci)
+	    ci = r.st.ci;
+	runs += r.st.runs;
+	stats->samples[p] = r.secs;
+    }
+    set_fsecs_setup(NULL);
+    stats->num_samples = time_procs;
+    stats->runs = runs;
+    stats->secs_min = min;
+    stats->secs_sd = sd;
+    stats->secs_ci = ci;
+
+    /* The median of the samples, sorted by insertion */
+    for (p = 0; p < time_procs; p++) {
+	x = stats->samples[p];
+	for (i = p; i > 0 && t[i-1] > x; i--)
+	    t[i] = t[i-1];
+	t[i] = x;
+    }
+    stats->secs = (p & 1) ? t[p/2] : (t[p/2 - 1] + t[p/2]) / 2;
+}
+
+/*
+ * run_parallel - Evaluate the tracefiles in jobs worker processes (-j).
+ *     Each worker is forked after mem_init, so it has a private copy of
+ *     the heap and of the mm package's state. Workers take the next
+ *     unclaimed trace until none are left and leave their results in
+ *     shared memory. Each worker is pinned to its own CPU, one per core
+ *     as far as the cores go, and the parent reports any trace whose
+ *     worker was preempted while it ran, since its timing is suspect.
+ */
+static void run_parallel(char **tracefiles, int num_tracefiles, 
+			 stats_t *mm_stats, range_t **ranges)
+{
+    result_t *res;
+    long *next;    /* next unclaimed trace */
+    int cpus[MAXJOBS];
+    pid_t pids[MAXJOBS];
+    int i, w, status, num_cpus, num_cores, workers;
+    struct rusage before, after;
+    cpu_set_t set;
+    size_t len;
+
+    num_cpus = pick_cpus(cpus, MAXJOBS, &num_cores);
+    workers = (jobs < num_tracefiles) ? jobs : num_tracefiles;
+    if (workers > num_cpus) {
+	printf("Warning: only %d CPUs for %d workers, using %d\n", 
+	       num_cpus, workers, num_cpus);
+	workers = num_cpus;
+    }
+    else if (workers > num_cores)
+	printf("Warning: %d workers share %d cores, timings may read low\n",
+	       workers, num_cores);
+
+    len = sizeof(long) + num_tracefiles * sizeof(result_t);
+    if ((next = mmap(NULL, len, PROT_READ | PROT_WRITE, 
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	unix_error("mmap failed in run_parallel");
+    res = (result_t *)(next + 1);
+    *next = 0;
+
+    fflush(stdout);  /* or the workers would print it again */
+    for (w = 0; w < workers; w++) {
+	if ((pids[w] = fork()) < 0)
+	    unix_error("fork failed in run_parallel");
+	if (pids[w] > 0)
+	    continue;
+
+	/* The worker */
+	CPU_ZERO(&set);
+	CPU_SET(cpus[w], &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+	    unix_error("sched_setaffinity failed in run_parallel");
+	while ((i = __sync_fetch_and_add(next, 1)) < num_tracefiles) {
+	    errors = 0;
+	    getrusage(RUSAGE_SELF, &before);
+	    eval_trace(tracefiles[i], i, &res[i].stats, ranges);
+	    getrusage(RUSAGE_SELF, &after);
+	    res[i].errors = errors;
+	    res[i].cpu = sched_getcpu();
+	    res[i].preempted = after.ru_nivcsw - before.ru_nivcsw;
+	    res[i].done = 1;
+	    fflush(stdout);
+	}
+	exit(0);
+    }
+
+    for (w = 0; w < workers; w++)
+	if (waitpid(pids[w], &status, 0) > 0 && WIFSIGNALED(status))
+	    printf("ERROR: worker on CPU %d killed by signal %d\n", 
+		   cpus[w], WTERMSIG(status));
+
+    for (i = 0; i < num_tracefiles; i++) {
+	if (!res[i].done) {
+	    printf("ERROR [trace %d]: %s\n", i, (i < *next) ? 
+		   "worker died evaluating it" : "no worker left to run it");
+	    res[i].stats.valid = 0;
+	    res[i].errors = 1;
+	}
+	mm_stats[i] = res[i].stats;
+	errors += res[i].errors;
+	if (res[i].done && (res[i].preempted > 0 || verbose > 1))
+	    printf("trace %d ran on CPU %d, preempted %ld times%s\n", i,
+		   res[i].cpu, res[i].preempted, 
+		   res[i].preempted ? ": its timing may be off" : "");
+    }
+    munmap(next, len);
+}
+
+/*
+ * pick_cpus - Fill cpus with the CPUs this process may run on, one CPU
+ *     of each core first and their hyperthread siblings after. Returns
+ *     the number of CPUs, and sets *num_cores to the number of cores.
+ */
+static int pick_cpus(int *cpus, int max, int *num_cores)
+{
+    cpu_set_t set;
+    int cpu, n = 0, i, j, pass;
+    int core[MAXJOBS];  /* package << 16 | core id of each CPU */
+    int taken;
+    char path[MAXLINE];
+    FILE *fp;
+    int ids[MAXJOBS], pkg, id;
+    int num_ids = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+	unix_error("sched_getaffinity failed in pick_cpus");
+
+    /* Find the core of every CPU we may use */
+    for (cpu = 0; cpu < CPU_SETSIZE && num_ids < max; cpu++) {
+	if (!CPU_ISSET(cpu, &set))
+	    continue;
+	pkg = 0;
+	id = cpu;
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+	if ((fp = fopen(path, "r")) != NULL) {
+	    if (fscanf(fp, "%d", &id) != 1)
+		id = cpu;
+	    fclose(fp);
+	}
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/"
+		"physical_package_id", cpu);
+	if ((fp = fopen(path, "r")) != NULL) {
+	    if (fscanf(fp, "%d", &pkg) != 1)
+		pkg = 0;
+	    fclose(fp);
+	}
+	ids[num_ids] = cpu;
+	core[num_ids++] = (pkg << 16) | id;
+    }
+
+    /* First pass: first CPU of each core; second pass: the rest */
+    *num_cores = 0;
+    for (pass = 0; pass < 2; pass++) {
+	for (i = 0; i < num_ids; i++) {
+	    for (taken = 0, j = 0; j < i; j++)
+		if (core[j] == core[i])
+		    taken = 1;
+	    if (taken == pass)
+		cpus[n++] = ids[i];
+	}
+	if (pass == 0)
+	    *num_cores = n;
+    }
+    return n;
+}
+
+/*
+ * run_threaded - Replay each trace with its threads spread over 1, 2, ...
+ *     up to max_threads pthreads (but no more than the trace has), and
+ *     print the aggregate throughput, the speedup over one pthread, and
+ *     the throughput of each pthread. The mm package is made thread safe
+ *     by the memlib lock for the length of the replays. Each count is
+ *     replayed REPLAYS times and the fastest run is kept.
+ */
+static void run_threaded(char **tracefiles, int num_tracefiles)
+{
+    trace_t *trace;
+    mtrace_t *mt;
+    replayer_t r[MAXTHREADS], best[MAXTHREADS];
+    double secs, best_secs, base_kops = 0, kops;
+    long ops;
+    int i, k, n, w;
+
+    mem_set_threads(1);
+    for (i = 0; i < num_tracefiles; i++) {
+	trace = read_trace(tracedir, tracefiles[i]);
+	mt = split_trace(trace, tracefiles[i]);
+	free_trace(trace);
+	if (mt == NULL)
+	    continue;
+
+	printf("\nThreaded replay of %s (%d thread%s):\n", tracefiles[i],
+	       mt->num_threads, (mt->num_threads == 1) ? "" : "s");
+	printf("%7s%10s%8s  %s\n", "threads", "Kops", "speedup", 
+	       "Kops per thread");
+	for (k = 1; k <= max_threads && k <= mt->num_threads; k++) {
+	    best_secs = DBL_MAX;
+	    for (n = 0; n < REPLAYS; n++) {
+		if ((secs = replay(mt, k, r)) < 0)
+		    break;
+		if (secs < best_secs) {
+		    best_secs = secs;
+		    memcpy(best, r, k * sizeof(replayer_t));
+		}
+	    }
+	    if (secs < 0) {
+		printf("ERROR [trace %d]: an allocator call failed in the "
+		       "threaded replay\n", i);
+		errors++;
+		break;
+	    }
+
+	    /* A replay too short to measure has no rate, shown as - */
+	    for (ops = 0, w = 0; w < k; w++)
+		ops += best[w].ops;
+	    kops = (best_secs > 0) ? (ops / 1e3) / best_secs : 0;
+	    if (k == 1)
+		base_kops = kops;
+	    printf("%7d", k);
+	    if (kops > 0)
+		printf("%10.0f", kops);
+	    else
+		printf("%10s", "-");
+	    if ((kops > 0) && (base_kops > 0))
+		printf("%8.2f ", kops / base_kops);
+	    else
+		printf("%8s ", "-");
+	    for (w = 0; w < k; w++) {
+		secs = best[w].stop - best[w].start;
+		if (secs > 0)
+		    printf(" %.0f", (best[w].ops / 1e3) / secs);
+		else
+		    printf(" -");
+	    }
+	    printf("\n");
+	}
+	free_mtrace(mt);
+    }
+    mem_set_threads(0);
+}
+
+/*
+ * split_trace - Split a trace into the request streams of its threads.
+ *     Only malloc, free and realloc can be replayed on threads. Since the
+ *     threads run in no fixed order, a thread may only use a block after
+ *     the last thread to use it is known to be done with it, i.e. it has
+ *     waited for an event posted after that use, directly or through
+ *     other threads. That is checked here with a vector clock per thread:
+ *     known[u][t] is how many requests of thread t happen before thread
+ *     u's next one. Returns NULL after printing the first problem.
+ */
+static mtrace_t *split_trace(trace_t *trace, char *filename)
+{
+    mtrace_t *mt;
+    tracecur_t cur;
+    traceop_t op;
+    int *known = NULL, *event_clock = NULL, *last_thread = NULL;
+    int *last_pos = NULL, *count = NULL;
+    int i, t, u, pos, nt;
+    long opnum;
+
+    if ((mt = (mtrace_t *)calloc(1, sizeof(mtrace_t))) == NULL)
+	unix_error("calloc failed in split_trace");
+
+    /* Count the threads, events and the requests of each thread */
+    if ((count = (int *)calloc(MAXTHREADS, sizeof(int))) == NULL)
+	unix_error("calloc failed in split_trace");
+    t = 0;
+    trace_start(&cur, &trace->file);
+    for (opnum = 0; trace_next(&cur, &op); opnum++) {
+	switch (op.type) {
+	case THREAD:
+	    if ((t = op.index) >= MAXTHREADS) {
+		printf("ERROR [%s, line %ld]: more than %d threads\n",
+		       filename, LINENUM(opnum), MAXTHREADS);
+		goto bad;
+	    }
+	    if (t >= mt->num_threads)
+		mt->num_threads = t + 1;
+	    continue;
+	case POST:
+	case WAIT:
+	    if (op.index >= mt->num_events)
+		mt->num_events = op.index + 1;
+	    break;
+	case ALLOC:
+	case FREE:
+	case REALLOC:
+	    break;
+	default:
+	    printf("ERROR [%s, line %ld]: only a, f, r, t, s and w requests "
+		   "can be replayed on threads\n", filename, LINENUM(opnum));
+	    goto bad;
+	}
+	count[t]++;
+    }
+    if (mt->num_threads == 0)
+	mt->num_threads = 1;
+    nt = mt->num_threads;
+    mt->num_ids = trace->num_ids;
+
+    if ((mt->streams = (tstream_t *)calloc(nt, sizeof(tstream_t))) == NULL ||
+	(mt->blocks = (char **)calloc(mt->num_ids + 1, sizeof(char *))) == NULL ||
+	(mt->posted = (int *)calloc(mt->num_events + 1, sizeof(int))) == NULL ||
+	(known = (int *)calloc(nt * nt, sizeof(int))) == NULL ||
+	(event_clock = (int *)malloc((mt->num_events + 1) * nt * sizeof(int)))
+	== NULL ||
+	(last_thread = (int *)malloc((mt->num_ids + 1) * sizeof(int))) == NULL ||
+	(last_pos = (int *)malloc((mt->num_ids + 1) * sizeof(int))) == NULL)
+	unix_error("malloc failed in split_trace");
+    for (t = 0; t < nt; t++)
+	if ((mt->streams[t].ops = (traceop_t *)
+	     malloc((count[t] + 1) * sizeof(traceop_t))) == NULL)
+	    unix_error("malloc failed in split_trace");
+    for (i = 0; i < mt->num_ids; i++)
+	last_thread[i] = -1;
+
+    /* Deal out the requests, checking that the threads are ordered */
+    t = 0;
+    trace_start(&cur, &trace->file);
+    for (opnum = 0; trace_next(&cur, &op); opnum++) {
+	if (op.type == THREAD) {
+	    t = op.index;
+	    continue;
+	}
+	pos = ++mt->streams[t].num_ops;
+	mt->streams[t].ops[pos - 1] = op;
+	known[t * nt + t] = pos;
+
+	switch (op.type) {
+	case POST:
+	    if (mt->posted[op.index]) {
+		printf("ERROR [%s, line %ld]: event %d is posted twice\n",
+		       filename, LINENUM(opnum), op.index);
+		goto bad;
+	    }
+	    mt->posted[op.index] = 1;
+	    memcpy(&event_clock[op.index * nt], &known[t * nt], 
+		   nt * sizeof(int));
+	    break;
+
+	case WAIT:
+	    if (!mt->posted[op.index]) {
+		printf("ERROR [%s, line %ld]: event %d is waited for before "
+		       "it is posted\n", filename, LINENUM(opnum), op.index);
+		goto bad;
+	    }
+	    for (u = 0; u < nt; u++)
+		if (event_clock[op.index * nt + u] > known[t * nt + u])
+		    known[t * nt + u] = event_clock[op.index * nt + u];
+	    break;
+
+	default: /* ALLOC, FREE, REALLOC */
+	    u = last_thread[op.index];
+	    if (u >= 0 && u != t && known[t * nt + u] < last_pos[op.index]) {
+		printf("ERROR [%s, line %ld]: thread %d uses block %d before "
+		       "thread %d is known to be done with it\n", filename,
+		       LINENUM(opnum), t, op.index, u);
+		goto bad;
+	    }
+	    last_thread[op.index] = t;
+	    last_pos[op.index] = pos;
+	    break;
+	}
+    }
+
+    free(count);
+    free(known);
+    free(event_clock);
+    free(last_thread);
+    free(last_pos);
+    return mt;
+
+ bad:
+    errors++;
+    free(count);
+    free(known);
+    free(event_clock);
+    free(last_thread);
+    free(last_pos);
+    free_mtrace(mt);
+    return NULL;
+}
+
+/*
+ * free_mtrace - Free a trace made by split_trace
+ */
+static void free_mtrace(mtrace_t *mt)
+{
+    int t;
+
+    if (mt->streams != NULL)
+	for (t = 0; t < mt->num_threads; t++)
+	    free(mt->streams[t].ops);
+    free(mt->streams);
+    free(mt->blocks);
+    free(mt->posted);
+    free(mt);
+}
+
+/*
+ * replay - Replay the threads of mt on a fresh heap with the given
+ *     number of pthreads, leaving what each measured in r. Returns the
+ *     time from the first start to the last finish, or -1 if an
+ *     allocator call failed.
+ */
+static double replay(mtrace_t *mt, int workers, replayer_t *r)
+{
+    pthread_t tid[MAXTHREADS];
+    double start, stop;
+    int t, w;
+
+    for (t = 0; t < mt->num_threads; t++)
+	mt->streams[t].next = 0;
+    memset(mt->posted, 0, (mt->num_events + 1) * sizeof(int));
+    mt->failed = 0;
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in replay");
+
+    for (w = 0; w < workers; w++) {
+	r[w].mt = mt;
+	r[w].id = w;
+	r[w].workers = workers;
+	r[w].ops = 0;
+	if (pthread_create(&tid[w], NULL, replay_thread, &r[w]) != 0)
+	    app_error("pthread_create failed in replay");
+    }
+    for (w = 0; w < workers; w++)
+	pthread_join(tid[w], NULL);
+    if (mt->failed)
+	return -1;
+
+    start = r[0].start;
+    stop = r[0].stop;
+    for (w = 1; w < workers; w++) {
+	if (r[w].start < start)
+	    start = r[w].start;
+	if (r[w].stop > stop)
+	    stop = r[w].stop;
+    }
+    return stop - start;
+}
+
+/*
+ * replay_thread - Body of one pthread of a threaded replay. It runs each
+ *     of its streams until the stream ends or must wait for an event that
+ *     has not been posted yet, then moves on to its next stream, and
+ *     yields the CPU when all of its unfinished streams are waiting.
+ */
+static void *replay_thread(void *arg)
+{
+    replayer_t *r = (replayer_t *)arg;
+    mtrace_t *mt = r->mt;
+    tstream_t *s;
+    traceop_t *op;
+    char *p;
+    int t, left, progress, blocked;
+
+    r->start = ftimer_now();
+    do {
+	left = progress = 0;
+	for (t = r->id; t < mt->num_threads; t += r->workers) {
+	    s = &mt->streams[t];
+	    for (blocked = 0; s->next < s->num_ops && !blocked; ) {
+		op = &s->ops[s->next];
+		switch (op->type) {
+		case ALLOC:
+		    if ((p = mm_malloc(op->size)) == NULL)
+			goto fail;
+		    mt->blocks[op->index] = p;
+		    r->ops++;
+		    break;
+		case REALLOC:
+		    if ((p = mm_realloc(mt->blocks[op->index], op->size)) == NULL)
+			goto fail;
+		    mt->blocks[op->index] = p;
+		    r->ops++;
+		    break;
+		case FREE:
+		    mm_free(mt->blocks[op->index]);
+		    r->ops++;
+		    break;
+		case POST:
+		    __atomic_store_n(&mt->posted[op->index], 1, __ATOMIC_RELEASE);
+		    break;
+		case WAIT:
+		    if (!__atomic_load_n(&mt->posted[op->index], __ATOMIC_ACQUIRE))
+			blocked = 1;
+		    break;
+		default:
+		    break;
+		}
+		if (!blocked) {
+		    s->next++;
+		    progress = 1;
+		}
+	    }
+	    if (s->next < s->num_ops)
+		left = 1;
+	}
+	if (left && !progress) {
+	    if (__atomic_load_n(&mt->failed, __ATOMIC_RELAXED))
+		break;
+	    sched_yield();
+	}
+    } while (left);
+    r->stop = ftimer_now();
+    return NULL;
+
+ fail:
+    __atomic_store_n(&mt->failed, 1, __ATOMIC_RELAXED);
+    r->stop = ftimer_now();
+    return NULL;
+}
+
+/*
+ * parse_budgets - Parse a comma-separated list of fit budgets. Returns
+ *     the number of budgets, or 0 if the list is malformed.
+ */
+static int parse_budgets(char *list, int *budgets, int max)
+{
+    int n = 0;
+    char *tok, *end;
+
+    for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+	if (n == max)
+	    return 0;
+	budgets[n] = (int)strtol(tok, &end, 10);
+	if ((*end != '\0') || (budgets[n] < 0))
+	    return 0;
+	n++;
+    }
+    return n;
+}
+
+/*
+ * parse_map_ops - Parse the requests to take heap maps after (-m): a
+ *     comma-separated list of request numbers, where /N means every N
+ *     requests. Returns -1 if the list is bad.
+ */
+static int parse_map_ops(char *list)
+{
+    char *tok, *end;
+    long op;
+    int i;
+
+    for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+	op = strtol(tok + (*tok == '/'), &end, 10);
+	if ((*end != '\0') || (op < 1))
+	    return -1;
+	if (*tok == '/') {
+	    map_every = op;
+	    continue;
+	}
+	if (num_map_ops == MAXMAPS)
+	    return -1;
+
+	/* Keep them in order */
+	for (i = num_map_ops++; (i > 0) && (map_ops[i-1] > op); i--)
+	    map_ops[i] = map_ops[i-1];
+	map_ops[i] = op;
+    }
+    return 0;
+}
+
+/*
+ * sweep_budgets - Run the whole set of traces once per fit budget and
+ *     print the average utilization and throughput of each run, i.e.,
+ *     the util/throughput frontier of the good-fit search.
+ */
+static void sweep_budgets(char **tracefiles, int num_tracefiles, 
+			  int *budgets, int num_budgets, range_t **ranges)
+{
+    int i, k;
+    double secs, ops, util;
+    stats_t *stats;
+
+    if ((stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t))) == NULL)
+	unix_error("stats calloc in sweep_budgets failed");
+
+    printf("%6s%8s%10s\n", "budget", "util", "Kops");
+    for (k = 0; k < num_budgets; k++) {
+	mm_set_fit_budget(budgets[k]);
+	run_mm(tracefiles, num_tracefiles, stats, ranges);
+	if (verbose) {
+	    printf("\nResults for fit budget %d:\n", budgets[k]);
+	    printresults(num_tracefiles, stats);
+	}
+
+	secs = ops = util = 0;
+	for (i = 0; i < num_tracefiles; i++) {
+	    secs += stats[i].secs;
+	    ops += stats[i].ops;
+	    util += stats[i].util;
 	}
+	if (errors == 0)
+	    printf("%6d%7.1f%%%10.0f\n", budgets[k],
+		   (util/num_tracefiles)*100.0, (ops/1e3)/secs);
+	else
+	    printf("%6d%8s%10s\n", budgets[k], "-", "-");
     }
+    free(stats);
 }
 
 /*************************************
@@ -916,7 +3190,10 @@ static void eval_libc_speed(void *ptr)
 
 
 /*
- * printresults - prints a performance summary for some malloc package
+ * printresults - prints a performance summary for some malloc package.
+ *     secs is the median run where the timer times runs one by one, and
+ *     then the fastest run, the standard deviation and the 95% confidence
+ *     interval of the mean (+/-) follow it, the last two as percentages.
  */
 static void printresults(int n, stats_t *stats) 
 {
@@ -924,54 +3201,558 @@ static void printresults(int n, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double rss_util = 0;
+    double rss = 0;     /* largest peak RSS of any trace */
+    double var = 0;     /* variance of the total secs */
+    int spread = 1;     /* do all traces have one? */
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%8s%8s%10s%10s%5s%6s%6s\n", 
+	   "trace", " valid", "util", "rssutil", "rss(KB)", "ops", "secs", 
+	   "min", "sd%", "+/-%", "Kops");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%7.0f%%%8.0f%8.0f%10.6f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
+		   stats[i].rss_util*100.0,
+		   stats[i].rss/1024,
 		   stats[i].ops,
-		   stats[i].secs,
-		   (stats[i].ops/1e3)/stats[i].secs);
+		   stats[i].secs);
+	    if (stats[i].runs > 0)
+		printf("%10.6f%5.1f%6.1f", stats[i].secs_min, 
+		       stats[i].secs_sd / stats[i].secs * 100,
+		       stats[i].secs_ci / stats[i].secs * 100);
+	    else
+		printf("%10s%5s%6s", "-", "-", "-");
+	    printf("%6.0f\n", (stats[i].ops/1e3)/stats[i].secs);
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    rss_util += stats[i].rss_util;
+	    if (stats[i].rss > rss)
+		rss = stats[i].rss;
+	    var += stats[i].secs_ci * stats[i].secs_ci;
+	    spread &= stats[i].runs > 0;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%8s%8s%8s%10s%10s%5s%6s%6s\n", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
+		   "-",
+		   "-",
+		   "-",
+		   "-",
+		   "-",
 		   "-");
 	}
     }
 
-    /* Print the aggregate results for the set of traces */
+    /* 
+     * Print the aggregate results for the set of traces. The traces are
+     * timed independently, so the intervals of the total add in quadrature.
+     */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%7.0f%%%8.0f%8.0f%10.6f%10s%5s", 
 	       "Total       ",
 	       (util/n)*100.0,
+	       (rss_util/n)*100.0,
+	       rss/1024,
 	       ops, 
 	       secs,
-	       (ops/1e3)/secs);
+	       "-",
+	       "-");
+	if (spread)
+	    printf("%6.1f", sqrt(var) / secs * 100);
+	else
+	    printf("%6s", "-");
+	printf("%6.0f\n", (ops/1e3)/secs);
     }
     else {
-	printf("%12s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%8s%8s%8s%10s%10s%5s%6s%6s\n", 
 	       "Total       ",
 	       "-", 
 	       "-", 
 	       "-", 
+	       "-", 
+	       "-", 
+	       "-", 
+	       "-", 
+	       "-", 
 	       "-");
     }
 
 }
 
+/*
+ * set_spread - Record the spread of the runs that timed a trace
+ */
+static void set_spread(stats_t *stats, ftimer_stats_t *st)
+{
+    stats->runs = st->runs;
+    stats->secs_min = st->min;
+    stats->secs_sd = st->stddev;
+    stats->secs_ci = st->ci;
+    if (verbose > 1 && st->runs > 0)
+	printf("Timed %d runs (%d outliers dropped): median %.6f, "
+	       "mean %.6f +/- %.6f, min %.6f, sd %.6f secs\n", st->runs, 
+	       st->outliers, st->median, st->mean, st->ci, st->min, st->stddev);
+}
+
+/*
+ * count_events - Count hardware events over PERF_RUNS runs of a speed
+ *     function, after fsecs has warmed up the caches (-P)
+ */
+static void count_events(void (*f)(void *), speed_t *params, stats_t *stats)
+{
+    double counts[PERF_EVENTS];
+    int i, j;
+
+    memset(stats->perf, 0, sizeof(stats->perf));
+    for (i = 0; i < PERF_RUNS; i++) {
+	speed_setup(params);
+	perf_start();
+	f(params);
+	perf_stop(counts);
+	for (j = 0; j < PERF_EVENTS; j++)
+	    stats->perf[j] = (counts[j] < 0) ? -1 : 
+		stats->perf[j] + counts[j] / PERF_RUNS;
+    }
+}
+
+/*
+ * printperf - Print the events counted on each trace (-P) per request,
+ *     and the instructions per cycle
+ */
+static void printperf(int n, stats_t *stats)
+{
+    double total[PERF_EVENTS], ops = 0;
+    int i, j;
+
+    memset(total, 0, sizeof(total));
+    printf("%5s", "trace");
+    for (j = 0; j < PERF_EVENTS; j++)
+	printf("%10s", perf_name(j));
+    printf("%6s\n", "IPC");
+    for (i = 0; i <= n; i++) {
+	double *c = (i < n) ? stats[i].perf : total;
+	double m = (i < n) ? stats[i].ops : ops;
+
+	if (i < n && !stats[i].valid) {
+	    printf("%2d%13s\n", i, "-");
+	    continue;
+	}
+	if (i < n)
+	    printf("%2d   ", i);
+	else
+	    printf("Total");
+	for (j = 0; j < PERF_EVENTS; j++) {
+	    if (c[j] < 0)
+		printf("%10s", "-");
+	    else
+		printf("%10.2f", c[j] / m);
+	    if (i < n)
+		total[j] = (c[j] < 0 || total[j] < 0) ? -1 : total[j] + c[j];
+	}
+	if (c[0] > 0 && c[1] >= 0)
+	    printf("%6.2f\n", c[1] / c[0]);
+	else
+	    printf("%6s\n", "-");
+	if (i < n)
+	    ops += m;
+    }
+}
+
+/*
+ * write_results - Write everything measured about each trace to path
+ *     (-o): as CSV, one row per allocator and trace, if path ends in
+ *     .csv, and otherwise as JSON. Values that weren't measured are
+ *     null in JSON and empty in CSV.
+ */
+static void write_results(char *path, char **tracefiles, int n, 
+			  stats_t *libc_stats, stats_t *mm_stats, 
+			  double perfindex)
+{
+    FILE *fp;
+    int i, j, csv;
+    size_t len = strlen(path);
+
+    csv = (len > 4) && !strcmp(path + len - 4, ".csv");
+    if ((fp = fopen(path, "w")) == NULL)
+	unix_error("Could not open the results file");
+    if (csv) {
+	fprintf(fp, "allocator,trace,valid,ops,secs,secs_min,secs_sd,"
+		"secs_ci,runs,secs_samples,kops,util,util_tw,rss,rss_util,lat_p50_ns,lat_p99_ns,"
+		"lat_p999_ns");
+	for (j = 0; j < PERF_EVENTS; j++)
+	    fprintf(fp, ",%s", perf_name(j));
+	fprintf(fp, "\n");
+    }
+    else {
+	fprintf(fp, "{\n  \"team\": ");
+	json_string(fp, team.teamname);
+	fprintf(fp, ",\n  \"perfindex\": %.1f,\n  \"errors\": %d", 
+		perfindex, errors);
+    }
+    for (j = 0; j < 2; j++) {
+	stats_t *stats = j ? mm_stats : libc_stats;
+	char *allocator = j ? "mm" : "libc";
+
+	if (stats == NULL)
+	    continue;
+	if (!csv)
+	    fprintf(fp, ",\n  \"%s\": [", allocator);
+	for (i = 0; i < n; i++) {
+	    if (!csv)
+		fprintf(fp, "%s\n    ", i ? "," : "");
+	    write_stats(fp, csv, allocator, tracefiles[i], &stats[i]);
+	}
+	if (!csv)
+	    fprintf(fp, "\n  ]");
+    }
+    if (!csv)
+	fprintf(fp, "\n}\n");
+    if (fclose(fp) != 0)
+	unix_error("Could not write the results file");
+}
+
+/*
+ * write_stats - Write the stats of one trace as a CSV row or JSON object
+ */
+static void write_stats(FILE *fp, int csv, char *allocator, char *trace, 
+			stats_t *stats)
+{
+    char *null = csv ? "" : "null";
+    char *sep = csv ? "," : ", ";
+    int j, valid = stats->valid;
+    int mm = !strcmp(allocator, "mm");   /* only mm has util and latency */
+
+    if (csv) {
+	fprintf(fp, "%s,", allocator);
+	if (strpbrk(trace, ",\"\n"))
+	    fprintf(fp, "\"%s\",%d", trace, valid);   /* quote, don't escape */
+	else
+	    fprintf(fp, "%s,%d", trace, valid);
+    }
+    else {
+	fprintf(fp, "{\"trace\": ");
+	json_string(fp, trace);
+	fprintf(fp, ", \"valid\": %d", valid);
+    }
+
+#define FIELD(name, fmt, val, ok) do {			\
+	if (!csv)					\
+	    fprintf(fp, "%s\"%s\": ", sep, name);	\
+	else						\
+	    fputs(sep, fp);				\
+	if (ok)						\
+	    fprintf(fp, fmt, val);			\
+	else						\
+	    fputs(null, fp);				\
+    } while (0)
+
+    FIELD("ops", "%.0f", stats->ops, 1);
+    FIELD("secs", "%.9f", stats->secs, valid);
+    FIELD("secs_min", "%.9f", stats->secs_min, valid && stats->runs);
+    FIELD("secs_sd", "%.9f", stats->secs_sd, valid && stats->runs);
+    FIELD("secs_ci", "%.9f", stats->secs_ci, valid && stats->runs);
+    FIELD("runs", "%d", stats->runs, valid && stats->runs);
+    if (!csv)
+	fprintf(fp, "%s\"secs_samples\": ", sep);
+    else
+	fputs(sep, fp);
+    if (valid && stats->num_samples) {
+	fputs(csv ? "" : "[", fp);
+	for (j = 0; j < stats->num_samples; j++)
+	    fprintf(fp, "%s%.9f", j ? (csv ? ";" : ", ") : "", 
+		    stats->samples[j]);
+	fputs(csv ? "" : "]", fp);
+    }
+    else
+	fputs(null, fp);
+    FIELD("kops", "%.3f", stats->ops / 1e3 / stats->secs, 
+	  valid && stats->secs > 0);
+    FIELD("util", "%.6f", stats->util, valid && mm);
+    FIELD("util_tw", "%.6f", stats->util_tw, valid && mm && !streaming);
+    FIELD("rss", "%.0f", stats->rss, valid && mm);
+    FIELD("rss_util", "%.6f", stats->rss_util, valid && mm);
+    FIELD("lat_p50_ns", "%.1f", stats->lat_p50, valid && mm && latency);
+    FIELD("lat_p99_ns", "%.1f", stats->lat_p99, valid && mm && latency);
+    FIELD("lat_p999_ns", "%.1f", stats->lat_p999, valid && mm && latency);
+    for (j = 0; j < PERF_EVENTS; j++)
+	FIELD(perf_name(j), "%.0f", stats->perf[j], 
+	      valid && perf && stats->perf[j] >= 0);
+#undef FIELD
+
+    fputs(csv ? "\n" : "}", fp);
+}
+
+/* json_string - Write s as a JSON string */
+static void json_string(FILE *fp, char *s)
+{
+    putc('"', fp);
+    for (; *s; s++) {
+	if (*s == '"' || *s == '\\')
+	    fprintf(fp, "\\%c", *s);
+	else if ((unsigned char)*s < ' ')
+	    fprintf(fp, "\\u%04x", *s);
+	else
+	    putc(*s, fp);
+    }
+    putc('"', fp);
+}
+
+/*
+ * read_baseline - Read the mm results of each trace from a results file
+ *     written by -o, in either format. Returns the number of traces, and
+ *     leaves them in a malloc'd array in *base.
+ */
+static int read_baseline(char *path, baseline_t **base)
+{
+    FILE *fp;
+    char *buf, *p, *q, *line, val[MAXLINE];
+    char *cols[64];
+    long len;
+    int n = 0, max = 16, ncols = 0, i;
+    baseline_t *b;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	unix_error("Could not open the baseline");
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    rewind(fp);
+    if ((buf = malloc(len + 1)) == NULL || 
+	(b = malloc(max * sizeof(baseline_t))) == NULL)
+	unix_error("malloc failed in read_baseline");
+    if (fread(buf, 1, len, fp) != len)
+	unix_error("Could not read the baseline");
+    buf[len] = '\0';
+    fclose(fp);
+
+    for (p = buf; *p == ' ' || *p == '\n'; p++)
+	;
+    if (*p == '{') {
+	/* JSON: an object for each trace in the "mm" array */
+	if ((p = strstr(p, "\"mm\"")) == NULL)
+	    app_error("The baseline has no mm results");
+	while ((p = strchr(p, '{')) != NULL && (q = strchr(p, '}')) != NULL) {
+	    *q = '\0';
+	    if (n == max && (b = realloc(b, (max *= 2) * sizeof(*b))) == NULL)
+		unix_error("realloc failed in read_baseline");
+	    memset(&b[n], 0, sizeof(b[n]));
+	    if (json_value(p, "trace", b[n].trace, MAXLINE) == NULL)
+		app_error("A trace in the baseline has no name");
+	    if (json_value(p, "valid", val, MAXLINE))
+		b[n].valid = atoi(val);
+	    if (json_value(p, "util", val, MAXLINE))
+		b[n].util = atof(val);
+	    if (json_value(p, "secs", val, MAXLINE))
+		b[n].secs = atof(val);
+	    if ((p = strstr(p, "\"secs_samples\": [")) != NULL)
+		b[n].num_samples = read_samples(strchr(p, '[') + 1, 
+						b[n].samples);
+	    n++;
+	    p = q + 1;
+	}
+    }
+    else {
+	/* CSV: the header names the columns of the rows that follow */
+	for (line = strtok(p, "\n"); line; line = strtok(NULL, "\n")) {
+	    char *f[64];
+	    int nf = 0;
+
+	    /* Split the line at commas outside quotes */
+	    for (q = line; nf < 64; ) {
+		if (*q == '"') {
+		    f[nf++] = ++q;
+		    if ((q = strchr(q, '"')) == NULL)
+			break;
+		    *q++ = '\0';
+		}
+		else 
+		    f[nf++] = q;
+		if ((q = strchr(q, ',')) == NULL)
+		    break;
+		*q++ = '\0';
+	    }
+	    if (ncols == 0) {
+		memcpy(cols, f, nf * sizeof(char *));
+		ncols = nf;
+		continue;
+	    }
+	    if (strcmp(f[0], "mm"))
+		continue;
+	    if (n == max && (b = realloc(b, (max *= 2) * sizeof(*b))) == NULL)
+		unix_error("realloc failed in read_baseline");
+	    memset(&b[n], 0, sizeof(b[n]));
+	    for (i = 0; i < nf && i < ncols; i++) {
+		if (!strcmp(cols[i], "trace"))
+		    snprintf(b[n].trace, MAXLINE, "%s", f[i]);
+		else if (!strcmp(cols[i], "valid"))
+		    b[n].valid = atoi(f[i]);
+		else if (!strcmp(cols[i], "util"))
+		    b[n].util = atof(f[i]);
+		else if (!strcmp(cols[i], "secs"))
+		    b[n].secs = atof(f[i]);
+		else if (!strcmp(cols[i], "secs_samples"))
+		    b[n].num_samples = read_samples(f[i], b[n].samples);
+	    }
+	    n++;
+	}
+    }
+    free(buf);
+    *base = b;
+    return n;
+}
+
+/*
+ * read_samples - Read up to MAXSAMPLES numbers separated by commas (a
+ *     JSON array) or semicolons (a CSV field) from p into t. Returns
+ *     how many it read.
+ */
+static int read_samples(char *p, double *t)
+{
+    char *end;
+    int n = 0;
+
+    while (n < MAXSAMPLES) {
+	t[n] = strtod(p, &end);
+	if (end == p)
+	    break;
+	n++;
+	for (p = end; *p == ' ' || *p == ',' || *p == ';'; p++)
+	    ;
+    }
+    return n;
+}
+
+/*
+ * json_value - Copy the value of key in the flat JSON object at p into
+ *     val, without quotes or escapes. Returns NULL if key isn't there.
+ */
+static char *json_value(char *p, char *key, char *val, int len)
+{
+    char pat[MAXLINE];
+    int i = 0;
+
+    snprintf(pat, sizeof(pat), "\"%s\":", key);
+    if ((p = strstr(p, pat)) == NULL)
+	return NULL;
+    for (p += strlen(pat); *p == ' '; p++)
+	;
+    if (*p == '"') {
+	for (p++; *p && *p != '"' && i < len - 1; p++) {
+	    if (*p == '\\' && p[1])
+		p++;
+	    val[i++] = *p;
+	}
+    }
+    else
+	while (*p && *p != ',' && *p != ' ' && i < len - 1)
+	    val[i++] = *p++;
+    val[i] = '\0';
+    return val;
+}
+
+/*
+ * compare_baseline - Compare the mm results with those in a baseline
+ *     (-b) trace by trace, and return the number of regressions. A trace
+ *     regresses if it no longer runs correctly, if its utilization drops
+ *     by more than UTIL_TOL, or if its median time grows by more than
+ *     REGRESS_MIN and by more than the noise: the widest range of the
+ *     medians that separate processes measured (-R) in either run. The
+ *     noise is unknown unless one run or the other timed in more than
+ *     one process, and then only REGRESS_MIN applies.
+ */
+static int compare_baseline(char *path, char **tracefiles, int n, 
+			    stats_t *mm_stats)
+{
+    baseline_t *base, *b;
+    int i, j, num_base, regressions = 0, unknown = 0;
+    double change, noise, range;
+    char *verdict;
+
+    num_base = read_baseline(path, &base);
+    printf("\nComparison with baseline %s:\n", path);
+    printf("%5s %-20s%7s%7s%10s%10s%8s%8s  %s\n", "trace", "name", 
+	   "util", "was", "Kops", "was", "change", "noise", "verdict");
+    for (i = 0; i < n; i++) {
+	stats_t *s = &mm_stats[i];
+
+	for (j = 0, b = NULL; j < num_base && b == NULL; j++)
+	    if (!strcmp(base[j].trace, tracefiles[i]))
+		b = &base[j];
+	printf("%2d    %-20.20s", i, tracefiles[i]);
+	if (b == NULL || !b->valid) {
+	    printf("%50s  %s\n", "", b ? "was invalid" : "not in baseline");
+	    continue;
+	}
+	if (!s->valid) {
+	    printf("%50s  REGRESSED: invalid\n", "");
+	    regressions++;
+	    continue;
+	}
+	change = s->secs / b->secs - 1;   /* + is slower */
+	noise = sample_range(b->samples, b->num_samples);
+	range = sample_range(s->samples, s->num_samples);
+	if (range > noise)
+	    noise = range;
+	if (noise >= 0)
+	    noise /= b->secs;
+	else
+	    unknown++;
+	if (b->util - s->util > UTIL_TOL)
+	    verdict = "REGRESSED: util";
+	else if (change > REGRESS_MIN && change > noise)
+	    verdict = "REGRESSED: slower";
+	else if (-change > REGRESS_MIN && -change > noise)
+	    verdict = "faster";
+	else
+	    verdict = "ok";
+	if (!strncmp(verdict, "REGRESSED", 9))
+	    regressions++;
+	printf("%6.1f%%%6.1f%%%10.0f%10.0f%+7.1f%%", s->util * 100, 
+	       b->util * 100, s->ops / 1e3 / s->secs, s->ops / 1e3 / b->secs,
+	       -change / (1 + change) * 100);
+	if (noise >= 0)
+	    printf("%7.1f%%", noise * 100);
+	else
+	    printf("%8s", "-");
+	printf("  %s\n", verdict);
+    }
+    printf("%d regression%s\n", regressions, (regressions == 1) ? "" : "s");
+    if (unknown)
+	printf("Noise unknown for %d trace%s: time with -R N for the "
+	       "spread between processes\n", unknown, (unknown == 1) ? "" : "s");
+    free(base);
+    return regressions;
+}
+
+/*
+ * sample_range - The range of the n samples in t, or -1 if there are
+ *     too few to have one
+ */
+static double sample_range(double *t, int n)
+{
+    double lo, hi;
+    int i;
+
+    if (n < 2)
+	return -1;
+    lo = hi = t[0];
+    for (i = 1; i < n; i++) {
+	if (t[i] < lo)
+	    lo = t[i];
+	if (t[i] > hi)
+	    hi = t[i];
+    }
+    return hi - lo;
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -993,10 +3774,10 @@ void unix_error(char *msg)
 /*
  * malloc_error - Report an error returned by the mm_malloc package
  */
-void malloc_error(int tracenum, int opnum, char *msg)
+void malloc_error(int tracenum, long opnum, char *msg)
 {
     errors++;
-    printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
+    printf("ERROR [trace %d, line %ld]: %s\n", tracenum, LINENUM(opnum), msg);
 }
 
 /* 
@@ -1004,14 +3785,32 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValLPHs] [-f <file>] [-t <dir>] [-p <policy>] [-k <K,...>] [-M <MB>] [-j <N>] [-T <N>] [-w <N>] [-c <pct>] [-o <file>] [-b <file>] [-u <N>] [-m <ops>] [-S <N>] [-A <N>] [-R <N>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-A <N>     Also check each trace in N processes on a shared heap (not with -s).\n");
+    fprintf(stderr, "\t-b <file>  Compare with baseline results from -o, exit 2 on a regression.\n");
+    fprintf(stderr, "\t-c <pct>   Time until the mean is within pct%% (default 1).\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Back the heap with 2 MiB huge pages.\n");
+    fprintf(stderr, "\t-j <N>     Evaluate traces in N pinned worker processes.\n");
+    fprintf(stderr, "\t-k <K,...> Sweep good-fit budgets K, print util/Kops per K (with -p addr).\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Report per-request latency percentiles (not with -s).\n");
+    fprintf(stderr, "\t-m <ops>   Write heap maps after requests N,... and every /N to heapmap-*.map (not with -s).\n");
+    fprintf(stderr, "\t-M <MB>    Heap capacity in MB (default %d).\n", MAX_HEAP >> 20);
+    fprintf(stderr, "\t-o <file>  Write all results to file, as CSV if it ends in .csv, else JSON.\n");
+    fprintf(stderr, "\t-p <policy> Free-list order: size (default) or addr.\n");
+    fprintf(stderr, "\t-P         Count hardware events per request (not with -s).\n");
+    fprintf(stderr, "\t-R <N>     Time each trace in N separate processes, for -o/-b (not with -s).\n");
+    fprintf(stderr, "\t-s         Stream traces through mm in one pass, not loaded.\n");
+    fprintf(stderr, "\t-S <N>     Check snapshot/restore of the heap every N requests (not with -s).\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <N>     Also replay each trace's threads on 1..N threads.\n");
+    fprintf(stderr, "\t-u <N>     Sample utilization every N requests to util-*.csv (not with -s).\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-w <N>     Untimed warm-up runs of each trace (default 2).\n");
 }
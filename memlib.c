@@ -2,14 +2,29 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            The heap is normally private, but mem_init_shared can place
+ *            it in a shared-memory object or file mapping instead. The brk
+ *            then lives in a control page at the front of the mapping, so
+ *            every attached process sees the same heap, and mem_lock 
+ *            serializes the processes.
+ *
+ *            A private heap reserves its whole capacity as address space
+ *            up front and commits pages as mem_sbrk reaches them. Pages
+ *            only become resident when touched, and mem_advise gives them
+ *            back, so memlib also accounts for the resident set (RSS).
+ *            mem_set_huge_pages backs the heap with 2 MiB pages instead.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
@@ -18,20 +33,352 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_peak_brk;   /* highest brk since the heap was last reset */
+static char *mem_commit_brk; /* end of the pages made accessible so far */
+static size_t mem_max_heap = MAX_HEAP; /* bytes to reserve at mem_init */
+static size_t mem_peak_rss_bytes;   /* most heap bytes resident at once */
+static unsigned char *mem_released_map; /* one bit per page released by
+					   mem_advise and not recommitted */
+static size_t mem_released_len;     /* length of mem_released_map */
+static size_t mem_released_bytes;   /* bytes marked in mem_released_map */
+
+#define COMMIT_STEP (1<<16)      /* bytes committed at a time */
+#define HUGE_PAGE   (1<<21)      /* 2 MiB huge page */
+
+/* Round an address to a multiple of u, a power of two */
+#define ROUND_DOWN(p, u) ((char *)((size_t)(p) & ~((size_t)(u) - 1)))
+#define ROUND_UP(p, u)   ROUND_DOWN((char *)(p) + (u) - 1, u)
+#define PAGE_DOWN(p) ROUND_DOWN(p, mem_pagesize())
+#define PAGE_UP(p)   ROUND_UP(p, mem_pagesize())
+
+/* Pages are released in whole huge pages so they are not split */
+#define RELEASE_UNIT ((mem_huge != MEM_PAGES_SMALL) ? HUGE_PAGE : mem_pagesize())
+
+static int mem_huge_wanted;         /* back the next heap with huge pages */
+static int mem_huge = MEM_PAGES_SMALL; /* backing of the current heap */
+static size_t mem_commit_step = COMMIT_STEP; /* bytes committed at a time */
+
+#define MEM_MAGIC   0x6d656d73   /* marks an initialized shared segment */
+#define ATTACH_WAIT 1000         /* ms to wait for a segment's creator */
+
+/* Control page at the front of a shared heap mapping */
+typedef struct {
+    unsigned int magic;      /* MEM_MAGIC once the creator is done */
+    size_t max;              /* heap capacity in bytes */
+    size_t brk;              /* heap size in bytes */
+    size_t peak;             /* peak heap size since the last reset */
+    pthread_mutex_t lock;    /* recursive, process-shared, robust */
+} mem_shared_t;
+
+static mem_shared_t *mem_ctl;  /* control page, NULL if the heap is private */
+static size_t mem_map_len;     /* length of the shared mapping */
+static int mem_fd = -1;        /* descriptor behind the shared mapping */
+
+/* Serializes the threads of this process when mem_set_threads is on */
+static int mem_threads;
+static pthread_mutex_t mem_thread_lock;
+
+/*
+ * mark_pages - set (released = 1) or clear the released bits of the pages
+ *    in the page-aligned range [lo, hi), keeping mem_released_bytes in step
+ */
+static void mark_pages(char *lo, char *hi, int released)
+{
+    size_t page = mem_pagesize();
+    size_t i = (lo - mem_start_brk) / page;
+    size_t end = (hi - mem_start_brk) / page;
+    unsigned char bit;
+
+    for (; i < end; i++) {
+	bit = 1 << (i % 8);
+	if (!(mem_released_map[i / 8] & bit) == !released)
+	    continue;
+	mem_released_map[i / 8] ^= bit;
+	if (released)
+	    mem_released_bytes += page;
+	else
+	    mem_released_bytes -= page;
+    }
+}
+
+/*
+ * clear_released - forget every released page, e.g., once the heap is
+ *    emptied or replaced
+ */
+static void clear_released(void)
+{
+    if (mem_released_bytes > 0) {
+	memset(mem_released_map, 0, mem_max_heap / mem_pagesize() / 8 + 1);
+	mem_released_bytes = 0;
+    }
+}
+
+/*
+ * load_brk, store_brk - in shared mode, bring the brk in from the control
+ *    page before using it, and publish it after changing it
+ */
+static void load_brk(void)
+{
+    if (mem_ctl) {
+	mem_brk = mem_start_brk + mem_ctl->brk;
+	mem_peak_brk = mem_start_brk + mem_ctl->peak;
+    }
+}
+
+static void store_brk(void)
+{
+    if (mem_ctl) {
+	mem_ctl->brk = mem_brk - mem_start_brk;
+	mem_ctl->peak = mem_peak_brk - mem_start_brk;
+    }
+}
+
+/*
+ * mem_set_max_heap - set the heap capacity used by the next mem_init or
+ *    mem_init_shared (MAX_HEAP by default)
+ */
+void mem_set_max_heap(size_t bytes)
+{
+    size_t page = mem_pagesize();
+
+    mem_max_heap = (bytes + page - 1) & ~(page - 1);
+}
+
+/*
+ * mem_set_huge_pages - ask for the next mem_init to back the heap with
+ *    2 MiB huge pages (off by default)
+ */
+void mem_set_huge_pages(int on)
+{
+    mem_huge_wanted = on;
+}
+
+/*
+ * mem_set_threads - make mem_lock serialize the threads of a private
+ *    heap, so several threads may call the allocator at once (off by
+ *    default, since the lock costs every call). A shared heap's lock
+ *    already serializes threads as well as processes.
+ */
+void mem_set_threads(int on)
+{
+    pthread_mutexattr_t attr;
+
+    if (on && !mem_threads) {
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&mem_thread_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+    }
+    else if (!on && mem_threads)
+	pthread_mutex_destroy(&mem_thread_lock);
+    mem_threads = on;
+}
+
+/*
+ * mem_huge_pages - returns the MEM_PAGES_* backing of the current heap
+ */
+int mem_huge_pages(void)
+{
+    return mem_huge;
+}
+
+/*
+ * reserve_huge - reserve mem_max_heap bytes aligned to a huge page. The
+ *    heap gets hugetlbfs pages if enough are set aside, else transparent
+ *    huge pages, else (if the kernel offers neither) ordinary pages.
+ *    Either way it is committed a huge page at a time.
+ */
+static char *reserve_huge(void)
+{
+    size_t len;
+    char *p, *base;
+
+    mem_max_heap = (size_t)ROUND_UP(mem_max_heap, HUGE_PAGE);
+    mem_commit_step = HUGE_PAGE;
+
+    /* Fails unless the pool holds enough free huge pages */
+    if ((p = mmap(NULL, mem_max_heap, PROT_NONE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+		  -1, 0)) != MAP_FAILED) {
+	mem_huge = MEM_PAGES_HUGETLB;
+	return p;
+    }
+
+    /* Over-reserve, then trim to a huge-page aligned range */
+    len = mem_max_heap + HUGE_PAGE;
+    if ((p = mmap(NULL, len, PROT_NONE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		  -1, 0)) == MAP_FAILED)
+	return p;
+    base = ROUND_UP(p, HUGE_PAGE);
+    if (base > p)
+	munmap(p, base - p);
+    munmap(base + mem_max_heap, (p + len) - (base + mem_max_heap));
+    if (madvise(base, mem_max_heap, MADV_HUGEPAGE) == 0)
+	mem_huge = MEM_PAGES_THP;
+    return base;
+}
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model. The whole capacity is
+ *    reserved as inaccessible address space; mem_sbrk commits pages as
+ *    the brk reaches them, so untouched capacity costs no memory.
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    mem_huge = MEM_PAGES_SMALL;
+    mem_commit_step = COMMIT_STEP;
+    if (mem_huge_wanted)
+	mem_start_brk = reserve_huge();
+    else
+	mem_start_brk = mmap(NULL, mem_max_heap, PROT_NONE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			     -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+    mem_max_addr = mem_start_brk + mem_max_heap; /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_peak_brk = mem_start_brk;
+    mem_commit_brk = mem_start_brk;
+
+    /* Mapped rather than calloc'd, so memlib works under a malloc built on it */
+    mem_released_len = mem_max_heap / mem_pagesize() / 8 + 1;
+    if ((mem_released_map = mmap(NULL, mem_released_len, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				 -1, 0)) == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
+	exit(1);
+    }
+}
+
+/*
+ * commit - make the heap accessible up to at least end, in COMMIT_STEP
+ *    steps (whole huge pages for a huge-page heap). Returns 0, or -1 if
+ *    the pages could not be committed.
+ */
+static int commit(char *end)
+{
+    size_t len;
+
+    if (end <= mem_commit_brk)
+	return 0;
+    len = (size_t)ROUND_UP(end - mem_commit_brk, mem_commit_step);
+    if (len > (size_t)(mem_max_addr - mem_commit_brk))
+	len = mem_max_addr - mem_commit_brk;
+    if (mprotect(mem_commit_brk, len, PROT_READ | PROT_WRITE) < 0)
+	return -1;
+    mem_commit_brk += len;
+    return 0;
+}
+
+/*
+ * release - drop the whole pages inside [addr, addr+len) from the
+ *    resident set. A shared heap keeps its pages, since other processes
+ *    may be using them. Returns the number of bytes released.
+ */
+static size_t release(void *addr, size_t len)
+{
+    char *lo = ROUND_UP(addr, RELEASE_UNIT);
+    char *hi = ROUND_DOWN((char *)addr + len, RELEASE_UNIT);
+
+    if (mem_ctl || (hi <= lo) || (madvise(lo, hi - lo, MADV_DONTNEED) < 0))
+	return 0;
+    return hi - lo;
+}
+
+/*
+ * mem_init_shared - model the heap in a shared mapping. A name of the
+ *    form "/name" is a POSIX shared-memory object, anything else is a 
+ *    file path. The first process creates and sizes the segment; later
+ *    ones attach to it. Returns 1 if the heap was created (the caller
+ *    then runs mm_init), 0 if an existing heap was attached (the caller
+ *    runs mm_attach), and -1 on error.
+ */
+int mem_init_shared(const char *name)
+{
+    size_t page = mem_pagesize();
+    int shm = (name[0] == '/') && (strchr(name + 1, '/') == NULL);
+    int created = 1;
+    int fd, i;
+    struct stat st;
+    pthread_mutexattr_t attr;
+    char *base;
+
+    fd = shm ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) 
+	     : open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if ((fd < 0) && (errno == EEXIST)) {
+	created = 0;
+	fd = shm ? shm_open(name, O_RDWR, 0) : open(name, O_RDWR);
+    }
+    if (fd < 0)
+	return -1;
+
+    if (created) {
+	mem_map_len = page + mem_max_heap;
+	if (ftruncate(fd, mem_map_len) < 0) {
+	    close(fd);
+	    return -1;
+	}
+    }
+    else {
+	/* The creator may not have sized the segment yet */
+	for (i = 0; ; i++) {
+	    if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	    }
+	    if ((size_t)st.st_size > page)
+		break;
+	    if (i == ATTACH_WAIT) {
+		close(fd);
+		errno = ETIMEDOUT;
+		return -1;
+	    }
+	    usleep(1000);
+	}
+	mem_map_len = st.st_size;
+    }
+
+    if ((base = mmap(NULL, mem_map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		     fd, 0)) == MAP_FAILED) {
+	close(fd);
+	return -1;
+    }
+    mem_ctl = (mem_shared_t *)base;
+
+    if (created) {
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&mem_ctl->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	mem_ctl->max = mem_map_len - page;
+	mem_ctl->brk = 0;
+	mem_ctl->peak = 0;
+	__sync_synchronize();
+	mem_ctl->magic = MEM_MAGIC;
+    }
+    else {
+	for (i = 0; mem_ctl->magic != MEM_MAGIC; i++) {
+	    if (i == ATTACH_WAIT) {
+		mem_deinit();
+		errno = ETIMEDOUT;
+		return -1;
+	    }
+	    usleep(1000);
+	}
+    }
+
+    mem_fd = fd;
+    mem_start_brk = base + page;
+    mem_max_addr = mem_start_brk + mem_ctl->max;
+    mem_commit_brk = mem_max_addr;   /* file pages are allocated on touch */
+    load_brk();
+    return created;
 }
 
 /* 
@@ -39,7 +386,42 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    if (mem_ctl) {
+	munmap(mem_ctl, mem_map_len);
+	close(mem_fd);
+	mem_ctl = NULL;
+	mem_fd = -1;
+    }
+    else {
+	munmap(mem_start_brk, mem_max_addr - mem_start_brk);
+	munmap(mem_released_map, mem_released_len);
+	mem_released_map = NULL;
+	mem_released_bytes = 0;
+    }
+}
+
+/*
+ * mem_lock, mem_unlock - serialize processes sharing the heap, or the
+ *    threads of this process after mem_set_threads. The lock is
+ *    recursive so allocator entry points may call each other. If a
+ *    process died holding it, the next owner takes it over as is.
+ */
+void mem_lock(void)
+{
+    if (mem_ctl) {
+	if (pthread_mutex_lock(&mem_ctl->lock) == EOWNERDEAD)
+	    pthread_mutex_consistent(&mem_ctl->lock);
+    }
+    else if (mem_threads)
+	pthread_mutex_lock(&mem_thread_lock);
+}
+
+void mem_unlock(void)
+{
+    if (mem_ctl)
+	pthread_mutex_unlock(&mem_ctl->lock);
+    else if (mem_threads)
+	pthread_mutex_unlock(&mem_thread_lock);
 }
 
 /*
@@ -48,26 +430,148 @@ void mem_deinit(void)
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    mem_peak_brk = mem_start_brk;
+    store_brk();
+    clear_released();
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. As
+ *    with sbrk, a negative incr shrinks the heap and returns the old brk.
+ *    Shrinking releases the pages above the new brk but keeps them
+ *    committed for the next growth.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(ptrdiff_t incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    load_brk();
+    old_brk = mem_brk;
+
+    if ( ((incr < 0) && (-incr > mem_brk - mem_start_brk)) || 
+	 ((incr > 0) && (incr > mem_max_addr - mem_brk)) ||
+	 (commit(mem_brk + incr) < 0)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
+    if (incr < 0)
+	mem_peak_rss();
     mem_brk += incr;
+    if (mem_brk > mem_peak_brk)
+	mem_peak_brk = mem_brk;
+    store_brk();
+    if (incr < 0) {
+	release(mem_brk, -incr);
+	if (mem_released_bytes > 0)
+	    mark_pages(PAGE_UP(mem_brk), PAGE_UP(old_brk), 0);
+    }
     return (void *)old_brk;
 }
 
+/*
+ * mem_advise - release the whole pages inside [addr, addr+len). They stay
+ *    committed and read back as zeros when next touched, and are marked
+ *    released until mem_recommit. Returns the number of bytes released.
+ */
+size_t mem_advise(void *addr, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = addr;
+    iov.iov_len = len;
+    return mem_advisev(&iov, 1);
+}
+
+/*
+ * mem_advisev - mem_advise for several ranges at once, sampling the RSS
+ *    only once
+ */
+size_t mem_advisev(const struct iovec *iov, int iovcnt)
+{
+    size_t n, total = 0;
+    char *lo;
+    int i;
+
+    if (mem_ctl || (iovcnt <= 0))
+	return 0;
+    mem_peak_rss();    /* the pages may be part of the peak */
+    for (i = 0; i < iovcnt; i++) {
+	lo = ROUND_UP(iov[i].iov_base, RELEASE_UNIT);
+	if ((n = release(iov[i].iov_base, iov[i].iov_len)) > 0)
+	    mark_pages(lo, lo + n, 1);
+	total += n;
+    }
+    return total;
+}
+
+/*
+ * mem_recommit - note that [addr, addr+len) is about to be reused. The
+ *    kernel brings released pages back lazily as they are touched, so
+ *    this only clears their released marks. Returns the number of bytes
+ *    that had been released.
+ */
+size_t mem_recommit(void *addr, size_t len)
+{
+    size_t before = mem_released_bytes;
+
+    if (before > 0)
+	mark_pages(PAGE_DOWN(addr), PAGE_UP((char *)addr + len), 0);
+    return before - mem_released_bytes;
+}
+
+/*
+ * mem_released - returns the number of heap bytes currently released
+ */
+size_t mem_released()
+{
+    return mem_released_bytes;
+}
+
+/*
+ * mem_reset_rss - release every heap page and restart the peak RSS, so
+ *    the next run is charged only for the pages it touches
+ */
+void mem_reset_rss(void)
+{
+    if (!mem_ctl && (mem_commit_brk > mem_start_brk))
+	madvise(mem_start_brk, mem_commit_brk - mem_start_brk, MADV_DONTNEED);
+    mem_peak_rss_bytes = 0;
+}
+
+/*
+ * mem_load - replace the heap with size bytes read from fd at offset,
+ *    leaving brk just past them. The bytes are read into the heap's own
+ *    pages rather than mapped from the file, so the heap stays anonymous
+ *    memory: released pages still read back as zeros, and the resident
+ *    set counts only the heap. Returns the heap base, or (void *)-1.
+ */
+void *mem_load(int fd, off_t offset, size_t size)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    if (size > (size_t)(mem_max_addr - mem_start_brk)) {
+	errno = ENOMEM;
+	return (void *)-1;
+    }
+    if (commit(mem_start_brk + size) < 0)
+	return (void *)-1;
+    while (done < size) {
+	if ((n = pread(fd, mem_start_brk + done, size - done, 
+		       offset + done)) <= 0)
+	    return (void *)-1;
+	done += n;
+    }
+
+    mem_brk = mem_start_brk + size;
+    mem_peak_brk = mem_brk;
+    store_brk();
+    clear_released();
+    return (void *)mem_start_brk;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -81,6 +585,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
+    load_brk();
     return (void *)(mem_brk - 1);
 }
 
@@ -89,9 +594,73 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
+    load_brk();
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peak_heapsize() - returns the largest heap size in bytes since the
+ *    heap was last reset, which is what the heap cost even if the 
+ *    allocator has since shrunk it
+ */
+size_t mem_peak_heapsize() 
+{
+    load_brk();
+    return (size_t)(mem_peak_brk - mem_start_brk);
+}
+
+/*
+ * mem_rss() - returns the number of heap bytes below the brk that are
+ *    resident, i.e., pages touched since they were last released
+ */
+size_t mem_rss() 
+{
+    static unsigned char *vec;
+    static size_t vec_len;
+    size_t page = mem_pagesize();
+    size_t npages, i, n = 0;
+
+    load_brk();
+    npages = (mem_brk - mem_start_brk + page - 1) / page;
+    if (npages == 0)
+	return 0;
+    if (npages > vec_len) {
+	if (vec != NULL)
+	    munmap(vec, vec_len);
+	vec_len = (size_t)PAGE_UP(npages);
+	if ((vec = mmap(NULL, vec_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+	    vec = NULL;
+	    vec_len = 0;
+	    return 0;
+	}
+    }
+    if (mincore(mem_start_brk, npages * page, vec) < 0)
+	return 0;
+    for (i = 0; i < npages; i++)
+	n += vec[i] & 1;
+    return n * page;
+}
+
+/*
+ * mem_peak_rss() - returns the largest RSS since the last mem_reset_rss.
+ *    Pages only leave the resident set through mem_advise, which samples
+ *    the RSS first, so the peak is exact.
+ */
+size_t mem_peak_rss() 
+{
+    size_t rss;
+
+    /* No sample can beat a peak that already covers the whole heap */
+    load_brk();
+    if (mem_peak_rss_bytes >= (size_t)(PAGE_UP(mem_brk) - mem_start_brk))
+	return mem_peak_rss_bytes;
+    rss = mem_rss();
+    if (rss > mem_peak_rss_bytes)
+	mem_peak_rss_bytes = rss;
+    return mem_peak_rss_bytes;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -1,11 +1,34 @@
 #include <unistd.h>
+#include <stddef.h>
+#include <sys/uio.h>
 
+/* Page backing of the heap, as reported by mem_huge_pages */
+#define MEM_PAGES_SMALL   0  /* ordinary pages */
+#define MEM_PAGES_THP     1  /* transparent huge pages */
+#define MEM_PAGES_HUGETLB 2  /* hugetlbfs pages */
+
+void mem_set_max_heap(size_t bytes);
+void mem_set_huge_pages(int on);
+void mem_set_threads(int on);
+int mem_huge_pages(void);
 void mem_init(void);               
+int mem_init_shared(const char *name);
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void mem_lock(void);
+void mem_unlock(void);
+void *mem_sbrk(ptrdiff_t incr);
 void mem_reset_brk(void); 
+size_t mem_advise(void *addr, size_t len);
+size_t mem_advisev(const struct iovec *iov, int iovcnt);
+size_t mem_recommit(void *addr, size_t len);
+size_t mem_released(void);
+void mem_reset_rss(void);
+void *mem_load(int fd, off_t offset, size_t size);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
+size_t mem_rss(void);
+size_t mem_peak_rss(void);
 size_t mem_pagesize(void);
 
@@ -12,12 +12,27 @@
 /*
  * 32-bit and 64-bit allocator incorporating implicit free lists,
  * first-fit placement (we removed the option to switch between fit methods for a performance boost),
- * and boundary tag coalescing. Blocks are aligned
+ * and boundary tag coalescing. Each segregated list is kept either in
+ * size order or in address order (see mm_set_policy), which turns the
+ * first-fit scan into best fit or address-ordered first fit. Blocks are aligned
  * to 8 byte boundaries. Minimum block size is 16 bytes.
+ *
+ * All allocator state lives in a root record at the bottom of the heap and
+ * links are heap offsets, so the heap can be mapped into several processes
+ * at different addresses (mem_init_shared, then mm_init in one process and
+ * mm_attach in the others). Every entry point holds the memlib lock.
+ * Processes exchange objects as offsets from mem_heap_lo(), never as raw
+ * pointers.
+ *
+ * Every so often mm_free releases the interior pages of large free blocks
+ * back to memlib (decommit_sweep); they fault back in when reused.
  */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -47,7 +62,20 @@ team_t team = {
 #define BUFFER (1<<7) /* Reallocation buffer */
 #define MINSIZE   16      /* Minimum block size */
 
-#define LISTS     20      /* Number of segregated lists */
+#define LISTS     MM_CLASSES /* Number of segregated lists */
+#define MAX_HEAPSIZE 0xfffffff8UL /* Largest heap that offsets can address */
+#define MAX_REQUEST (MAX_HEAPSIZE - CHUNKSIZE) /* Largest payload asked for;
+                                  the rest leaves room to round and pad it
+                                  without overflowing a header */
+#define HSLOTS    64      /* Initial number of handle table slots */
+#define REGION_CHUNK (1<<12) /* Payload bytes carved per region chunk */
+#define DECOMMIT_MIN   (1<<16) /* Free blocks this large give back their pages */
+#define DECOMMIT_BATCH (1<<20) /* Large freed bytes that call for a sweep */
+#define DECOMMIT_EVERY 256     /* Fewest frees between two sweeps */
+#define DECOMMIT_IOV   64      /* Blocks released per mem_advisev call */
+#define SNAP_MAGIC 0x6d6d736e  /* Heap snapshot file magic ("nsmm") */
+#define SNAP_HDRSIZE 4096      /* Snapshot header, padded to keep the image
+                                  page aligned in the file */
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
 /* Basic constants and macros */
@@ -73,8 +101,16 @@ team_t team = {
 // Put and clear reallocation bit
 #define PUT_NOTAG(p, val) (*(unsigned int *)(p) = (val))
 
+/*
+ * Pointers stored inside the heap are offsets from the heap base, with 0
+ * standing for NULL (offset 0 is the alignment padding word, never a
+ * block). A heap image is then valid wherever it is mapped.
+ */
+#define TO_OFF(bp)  ((bp) ? (unsigned int)((char *)(bp) - heap_base) : 0)
+#define TO_PTR(off) ((off) ? heap_base + (off) : (char *)NULL)
+
 /* Store predecessor or successor pointer for free blocks */
-#define SET_PTR(p, bp) (*(unsigned int *)(p) = (unsigned int)(bp))
+#define SET_PTR(p, bp) (*(unsigned int *)(p) = TO_OFF(bp))
 
 
 
@@ -90,6 +126,14 @@ team_t team = {
 //line:vm:mm:get:alloc
 #define GET_TAG(p)   (GET(p) & 0x2)
 
+/* Blocks allocated through the handle API may be moved by mm_compact */
+#define MOVABLE       0x4
+#define GET_MOVABLE(p) (GET(p) & MOVABLE)
+
+/* The same bit on a free block: its interior pages have been released */
+#define DECOMMITTED   0x4
+#define GET_DECOMMITTED(p) (GET(p) & DECOMMITTED)
+
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp)       ((char *)(bp) - WSIZE)
 #define FTRP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
@@ -102,20 +146,76 @@ team_t team = {
 #define SUCC_PTR(bp) ((char *)(bp) + WSIZE)
 
 /* Address of free block's predecessor and successor on the segregated list */
-#define PRED(bp) (*(char **)(bp))
-#define SUCC(bp) (*(char **)(SUCC_PTR(bp)))
+#define PRED(bp) TO_PTR(*(unsigned int *)(bp))
+#define SUCC(bp) TO_PTR(*(unsigned int *)(SUCC_PTR(bp)))
 
 
 
 
 /* $end mallocmacros */
 
+/*
+ * A region lives at the start of its first chunk. Every chunk begins
+ * with a DSIZE link area whose first word points to the chunk before it.
+ */
+struct mm_region {
+    unsigned int chunks; /* Most recent chunk */
+    unsigned int bump;   /* Next free byte of the bump chunk */
+    unsigned int limit;  /* End of the bump chunk's payload */
+};
+
+#define CHUNK_LINK(c) (*(unsigned int *)(c))
+
+/*
+ * Allocator state that every user of the heap must agree on. It sits at
+ * heap offset 0, ahead of the prologue, so it travels with a heap image
+ * and is seen by every process sharing the heap.
+ */
+typedef struct {
+    unsigned int free_lists[LISTS]; /* List heads */
+    unsigned int fingers[LISTS];    /* Last insert point per list (address-ordered) */
+    unsigned int prologue;          /* Prologue block */
+    unsigned int htable;            /* Handle table (an ordinary block) */
+    int hcap;                       /* Number of slots in the handle table */
+    int hfree_slot;                 /* First free handle slot, -1 if none */
+    int policy;                     /* Free-list ordering policy */
+} root_t;
+
+#define ROOTSIZE ALIGN(sizeof(root_t))
+
+/* Access the list heads, fingers and handle table through the root */
+#define LIST(i)          TO_PTR(root->free_lists[i])
+#define SET_LIST(i, bp)  (root->free_lists[i] = TO_OFF(bp))
+#define FINGER(i)        TO_PTR(root->fingers[i])
+#define SET_FINGER(i, bp) (root->fingers[i] = TO_OFF(bp))
+#define HTABLE           ((hslot_t *)TO_PTR(root->htable))
+
+/*
+ * Header of a heap snapshot file. The heap image, root included,
+ * follows at offset SNAP_HDRSIZE.
+ */
+typedef struct {
+    unsigned int magic;
+    unsigned int heapsize;          /* Bytes of heap image */
+} snapshot_t;
+
+/*
+ * Handle table entry. A handle is the index of its slot. Free slots are
+ * chained through locks.
+ */
+typedef struct {
+    unsigned int bp; /* Block of the object (heap offset), 0 if free */
+    int locks;   /* Lock count, or next free slot if the slot is free */
+} hslot_t;
+
 /* Global variables */
-  /* Pointer to first block */
-void *free_lists[LISTS];
+static char *heap_base;       /* mem_heap_lo(), the origin of heap offsets */
+static root_t *root;          /* Shared allocator state at heap_base */
+static int policy = MM_SIZE_ORDERED; /* Policy for the next mm_init */
+static int fit_budget = 0;    /* Good-fit candidates to examine (0: first fit) */
+static size_t decommit_pending; /* Large free bytes since the last sweep */
+static int frees_since_sweep;   /* mm_free calls since the last sweep */
 char *prologue_block;
-static char *rover;           /* Next fit rover */
-static char *heap_listp = 0;
 /* Function prototypes for internal helper routines */
 static void *extend_heap(size_t size);
 static void place(void *bp, size_t asize);
@@ -125,33 +225,98 @@ static void printblock(void *bp);
 static void checkheap(int verbose);
 static void checkblock(void *bp);
 static void insert_node(void *bp, size_t size);
+static void insert_by_addr(void *bp, int list);
 static void delete_node(void *bp);
+static int grow_htable(void);
+static char *region_chunk(size_t size);
+static void trim_heap(void);
+static int writev_all(int fd, struct iovec *iov, int iovcnt);
+static void *realloc_block(void *ptr, size_t size, int may_move);
+static void *region_alloc(mm_region_t *r, size_t size);
+static void decommit_sweep(void);
+
+
+/*
+ * mm_set_policy - Select how blocks are ordered within each segregated
+ *     list. Takes effect at the next mm_init, since the lists of a live
+ *     heap are already ordered by the old policy.
+ */
+void mm_set_policy(int new_policy)
+{
+    policy = new_policy;
+}
 
 
+/*
+ * mm_set_fit_budget - Set how many fitting blocks find_fit may examine
+ *     before settling for the tightest one seen. Zero keeps plain first
+ *     fit. Only address-ordered lists (MM_ADDR_ORDERED) use it.
+ */
+void mm_set_fit_budget(int k)
+{
+    fit_budget = (k > 0) ? k : 0;
+}
+
 /*
  * mm_init - Initialize the memory manager
  */
 
 int mm_init(void)
 {
-   int i = 0;
-   char *heap_listp;
-   for (i = 0; i < LISTS; i++) {
-     free_lists[i] = NULL;
-    }
-    /* Create the initial empty heap */
-   if ((long)(heap_listp = mem_sbrk(4*WSIZE)) == -1) //line:vm:mm:begininit
+    int i = 0;
+    char *heap_listp;
+
+    mem_lock();
+    /* Create the initial empty heap, with the root in front */
+    if ((long)(heap_base = mem_sbrk(ROOTSIZE + 4*WSIZE)) == -1) { //line:vm:mm:begininit
+        mem_unlock();
         return -1;
+    }
+    root = (root_t *)heap_base;
+    for (i = 0; i < LISTS; i++) {
+        root->free_lists[i] = 0;
+        root->fingers[i] = 0;
+    }
+    root->htable = 0;
+    root->hcap = 0;
+    root->hfree_slot = -1;
+    root->policy = policy;
+    decommit_pending = 0;
+    frees_since_sweep = 0;
+
+    heap_listp = heap_base + ROOTSIZE;
     PUT_NOTAG(heap_listp, 0);                            /* Alignment padding */
     PUT_NOTAG(heap_listp + (1 * WSIZE), PACK(DSIZE, 1)); /* Prologue header */
     PUT_NOTAG(heap_listp + (2 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
     PUT_NOTAG(heap_listp + (3 * WSIZE), PACK(0, 1)); /* Epilogue header */
 
-     prologue_block = heap_listp + DSIZE;
+    prologue_block = heap_listp + DSIZE;
+    root->prologue = TO_OFF(prologue_block);
 
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-    if (extend_heap(CHUNKSIZE) == NULL)
+    if (extend_heap(CHUNKSIZE) == NULL) {
+        mem_unlock();
         return -1;
+    }
+    mem_unlock();
+    return 0;
+}
+
+/*
+ * mm_attach - Start using a heap that another process set up with
+ *     mm_init in a shared mapping (see mem_init_shared)
+ */
+int mm_attach(void)
+{
+    mem_lock();
+    if (mem_heapsize() < ROOTSIZE + 4*WSIZE) {
+        mem_unlock();
+        return -1;
+    }
+    heap_base = mem_heap_lo();
+    root = (root_t *)heap_base;
+    prologue_block = TO_PTR(root->prologue);
+    mem_unlock();
     return 0;
 }
 
@@ -163,10 +328,9 @@ void *mm_malloc(size_t size)
     size_t asize;      /* Adjusted block size */
     size_t extendsize; /* Amount to extend heap if no fit */
     char *bp = NULL;
-    int list = 0;
 
-    /* Ignore spurious requests */
-    if (size == 0)
+    /* Ignore spurious requests, and ones no block size can hold */
+    if ((size == 0) || (size > MAX_REQUEST))
         return NULL;
 
     /* Adjust block size to include overhead and alignment reqs. */
@@ -175,32 +339,20 @@ void *mm_malloc(size_t size)
     else
         asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE);
 
-    size = asize;
-    /* Select a free block of sufficient size from segregated list */
-    while (list < LISTS) {
-      if ((list == LISTS - 1) || ((size <= 1) && (free_lists[list] != NULL))) {
-	bp = free_lists[list];
-	// Ignore blocks that are too small or marked with the reallocation bit
-	while ((bp != NULL)
-	       && ((asize > GET_SIZE(HDRP(bp))) || (GET_TAG(HDRP(bp)))))
-	  {
-	    bp = PRED(bp);
-	  }
-	if (bp != NULL)
-	  break;
-      }
-
-      size >>= 1;
-      list++;
-    }
+    /* Search the segregated lists for a free block */
+    mem_lock();
+    bp = find_fit(asize);
 
     /* No fit found. Get more memory and place the block */
     if (bp == NULL){
       extendsize = MAX(asize,CHUNKSIZE);
-      if ((bp = extend_heap(extendsize)) == NULL)
+      if ((bp = extend_heap(extendsize)) == NULL) {
+        mem_unlock();
         return NULL;
+      }
     }
     place(bp, asize);
+    mem_unlock();
     return bp;
 }
 
@@ -210,12 +362,33 @@ void *mm_malloc(size_t size)
 
 void mm_free(void *bp)
 {
-    size_t size = GET_SIZE(HDRP(bp));
+    size_t size;
+
+    mem_lock();
+    size = GET_SIZE(HDRP(bp));
     CLEAR_TAG(HDRP(NEXT_BLKP(bp)));
     PUT(HDRP(bp), PACK(size, 0));
     PUT(FTRP(bp), PACK(size, 0));
     insert_node(bp, size);
-    coalesce(bp);
+    bp = coalesce(bp);
+
+    /*
+     * Large free blocks are decommitted in batches. Count what this free
+     * adds to them; a large free merged into an already decommitted block
+     * makes the whole block a candidate again.
+     */
+    if (GET_SIZE(HDRP(bp)) >= DECOMMIT_MIN) {
+        if ((size >= DECOMMIT_MIN) && GET_DECOMMITTED(HDRP(bp))) {
+            PUT(HDRP(bp), GET(HDRP(bp)) & ~DECOMMITTED);
+            PUT(FTRP(bp), GET(FTRP(bp)) & ~DECOMMITTED);
+        }
+        if (!GET_DECOMMITTED(HDRP(bp)))
+            decommit_pending += size;
+    }
+    if ((++frees_since_sweep >= DECOMMIT_EVERY) &&
+        (decommit_pending >= DECOMMIT_BATCH))
+        decommit_sweep();
+    mem_unlock();
     return;
 }
 
@@ -228,39 +401,41 @@ static void *coalesce(void *bp)
     size_t prev_alloc = GET_ALLOC(HDRP(PREV_BLKP(bp)));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
+    size_t dc = GET_DECOMMITTED(HDRP(bp)); /* Merged block keeps any release */
 
-
+    /* A block tagged for a realloc is kept for it, not merged */
+    if (GET_TAG(HDRP(PREV_BLKP(bp))))
+        prev_alloc = 1;
 
     if (prev_alloc && next_alloc) {
-        return bp;
         /* Case 1 */
-    }
-
-
-    if (GET_TAG(HDRP(PREV_BLKP(bp)))){
-      prev_alloc = 1;
+        return bp;
     }
     delete_node(bp);
     if (prev_alloc && !next_alloc) {
         /* Case 2 */
         delete_node(NEXT_BLKP(bp));
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(bp), PACK(size, 0));
-        PUT(FTRP(bp), PACK(size, 0));
+        dc |= GET_DECOMMITTED(HDRP(NEXT_BLKP(bp)));
+        PUT(HDRP(bp), PACK(size, dc));
+        PUT(FTRP(bp), PACK(size, dc));
     } else if (!prev_alloc && next_alloc) {
         /* Case 3 */
         delete_node(PREV_BLKP(bp));
         size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-        PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+        dc |= GET_DECOMMITTED(HDRP(PREV_BLKP(bp)));
+        PUT(FTRP(bp), PACK(size, dc));
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, dc));
         bp = PREV_BLKP(bp);
     } else {
     /* Case 4 */
         delete_node(PREV_BLKP(bp));
         delete_node(NEXT_BLKP(bp));
         size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+        dc |= GET_DECOMMITTED(HDRP(PREV_BLKP(bp))) |
+              GET_DECOMMITTED(HDRP(NEXT_BLKP(bp)));
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, dc));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, dc));
         bp = PREV_BLKP(bp);
     }
     insert_node(bp,size);
@@ -274,20 +449,51 @@ static void *coalesce(void *bp)
  * mm_realloc - Naive implementation of realloc
  */
 void *mm_realloc(void *ptr, size_t size)
+{
+  void *new_ptr;
+
+  mem_lock();
+  new_ptr = realloc_block(ptr, size, 1);
+  mem_unlock();
+  return new_ptr;
+}
+
+/*
+ * mm_resize - Grow or shrink a block where it is. Returns ptr, or NULL
+ *     if the block would have to move, in which case it is untouched.
+ */
+void *mm_resize(void *ptr, size_t size)
+{
+  void *new_ptr;
+
+  mem_lock();
+  new_ptr = realloc_block(ptr, size, 0);
+  mem_unlock();
+  return new_ptr;
+}
+
+/*
+ * realloc_block - mm_realloc with the heap lock held, or mm_resize if
+ *     the block may not move
+ */
+static void *realloc_block(void *ptr, size_t size, int may_move)
 {
   void *new_ptr = ptr;
+  char *next;
   size_t nsize = size;
-  int unallocated;
-  int extendsize;
-  int block_buffer;
-
-  if (ptr == NULL){
-    extendsize = MAX(nsize,CHUNKSIZE);
-    if ((ptr = extend_heap(extendsize)) == NULL)
-      return NULL;
-  }
+  size_t avail;
+  size_t extendsize;
+  size_t block_buffer;
+  int at_end;
 
-  if (size == 0)
+  if (ptr == NULL)
+    return mm_malloc(size);
+
+  if (size == 0) {
+    mm_free(ptr);
+    return NULL;
+  }
+  if (size > MAX_REQUEST)
     return NULL;
 
   if (nsize <= DSIZE) {
@@ -298,48 +504,610 @@ void *mm_realloc(void *ptr, size_t size)
 
   nsize += BUFFER;
 
-  block_buffer = GET_SIZE(HDRP(ptr)) - nsize;
-
-  if (block_buffer < 0) {
-    if (!GET_ALLOC(HDRP(NEXT_BLKP(ptr))) || !GET_SIZE(HDRP(NEXT_BLKP(ptr)))) {
-      unallocated = GET_SIZE(HDRP(ptr)) + GET_SIZE(HDRP(NEXT_BLKP(ptr))) - nsize;
-      if (unallocated < 0) {
-        extendsize = MAX(-unallocated, CHUNKSIZE);
+  if (GET_SIZE(HDRP(ptr)) < nsize) {
+    /*
+     * Grow in place into a free next block. The heap can only be
+     * extended to make up the difference if that block (or this one)
+     * is the last in the heap.
+     */
+    next = NEXT_BLKP(ptr);
+    avail = GET_SIZE(HDRP(ptr));
+    if (!GET_ALLOC(HDRP(next)))
+      avail += GET_SIZE(HDRP(next));
+    at_end = !GET_SIZE(HDRP(next)) ||
+      (!GET_ALLOC(HDRP(next)) && !GET_SIZE(HDRP(NEXT_BLKP(next))));
+
+    if ((!GET_ALLOC(HDRP(next)) && (avail >= nsize)) || at_end) {
+      if (avail < nsize) {
+        /* The tag kept next for us; let the new space merge with it */
+        if (GET_SIZE(HDRP(next)))
+          CLEAR_TAG(HDRP(next));
+        extendsize = MAX(nsize - avail, CHUNKSIZE);
         if (extend_heap(extendsize) == NULL)
           return NULL;
-        unallocated += extendsize;
+        next = NEXT_BLKP(ptr);
       }
 
-      delete_node(NEXT_BLKP(ptr));
-
-      PUT_NOTAG(HDRP(ptr), PACK(nsize + unallocated, 1));
-      PUT_NOTAG(FTRP(ptr), PACK(nsize + unallocated, 1));
+      if (GET_DECOMMITTED(HDRP(next)))
+        mem_recommit(next, GET_SIZE(HDRP(next)));
+      delete_node(next);
+
+      avail = GET_SIZE(HDRP(ptr)) + GET_SIZE(HDRP(next));
+      if (avail >= nsize + 2 * BUFFER + MINSIZE) {
+        /* Keep enough slack not to need the tag, and free the rest */
+        PUT(HDRP(ptr), PACK(nsize + 2 * BUFFER, 1));
+        PUT(FTRP(ptr), PACK(nsize + 2 * BUFFER, 1));
+        next = NEXT_BLKP(ptr);
+        PUT_NOTAG(HDRP(next), PACK(avail - nsize - 2 * BUFFER, 0));
+        PUT_NOTAG(FTRP(next), PACK(avail - nsize - 2 * BUFFER, 0));
+        insert_node(next, avail - nsize - 2 * BUFFER);
+      } else {
+        PUT(HDRP(ptr), PACK(avail, 1));
+        PUT(FTRP(ptr), PACK(avail, 1));
+      }
+    } else if (!may_move) {
+      /* No room for the slack, but it may still hold size bytes */
+      return (GET_SIZE(HDRP(ptr)) - DSIZE >= size) ? ptr : NULL;
     } else {
-      new_ptr = mm_malloc(nsize - DSIZE);
-      memmove(new_ptr, ptr, MIN(size, nsize));
+      if ((new_ptr = mm_malloc(nsize - DSIZE)) == NULL)
+        return NULL;
+      memcpy(new_ptr, ptr, MIN(size, GET_SIZE(HDRP(ptr)) - DSIZE));
       mm_free(ptr);
     }
-    block_buffer = GET_SIZE(HDRP(new_ptr)) - nsize;
   }
-
-  if (block_buffer < 2 * BUFFER)
-    SET_TAG(HDRP(NEXT_BLKP(new_ptr)));
+  block_buffer = GET_SIZE(HDRP(new_ptr)) - nsize;
+
+  /*
+   * Hold back the free block right after this one for it to grow into,
+   * unless that block is bigger than this one; it would take at least a
+   * doubling to need it all, and it is too much to leave idle.
+   */
+  next = NEXT_BLKP(new_ptr);
+  if ((block_buffer < 2 * BUFFER) && !GET_ALLOC(HDRP(next)) &&
+      (GET_SIZE(HDRP(next)) <= GET_SIZE(HDRP(new_ptr))))
+    SET_TAG(HDRP(next));
 
 return new_ptr;
 }
 
+/*
+ * mm_memalign - Allocate a block whose payload starts at a multiple of
+ *     align bytes (a power of two). Enough is allocated to slide the
+ *     payload up to the boundary; the space in front of it and any
+ *     excess behind it go back on the free lists.
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+    char *bp, *abp, *next;
+    size_t asize, total, front;
+
+    if (align <= ALIGNMENT)
+        return mm_malloc(size);
+    if ((size == 0) || (size > MAX_REQUEST) || (align > MAX_REQUEST - size))
+        return NULL;
+    if (size <= DSIZE)
+        asize = 2*DSIZE;
+    else
+        asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE);
+
+    mem_lock();
+    if ((bp = mm_malloc(size + align + MINSIZE)) == NULL) {
+        mem_unlock();
+        return NULL;
+    }
+    total = GET_SIZE(HDRP(bp));
+
+    /* Free the front, which must be big enough to make a block */
+    if ((size_t)bp & (align - 1)) {
+        abp = (char *)(((size_t)bp + align - 1) & ~(align - 1));
+        if (abp - bp < MINSIZE)
+            abp += align;
+        front = abp - bp;
+        PUT_NOTAG(HDRP(abp), PACK(total - front, 1));
+        PUT_NOTAG(FTRP(abp), PACK(total - front, 1));
+        PUT(HDRP(bp), PACK(front, 0));
+        PUT(FTRP(bp), PACK(front, 0));
+        insert_node(bp, front);
+        coalesce(bp);
+        bp = abp;
+        total -= front;
+    }
+
+    /* Free what is left over behind the payload */
+    if (total - asize >= MINSIZE) {
+        PUT(HDRP(bp), PACK(asize, 1));
+        PUT(FTRP(bp), PACK(asize, 1));
+        next = NEXT_BLKP(bp);
+        PUT_NOTAG(HDRP(next), PACK(total - asize, 0));
+        PUT_NOTAG(FTRP(next), PACK(total - asize, 0));
+        insert_node(next, total - asize);
+        coalesce(next);
+    }
+    mem_unlock();
+    return bp;
+}
+
+/*
+ * mm_usable_size - Return the payload bytes of an allocated block, which
+ *     may be more than were asked for
+ */
+size_t mm_usable_size(void *ptr)
+{
+    return GET_SIZE(HDRP(ptr)) - DSIZE;
+}
+
+/*
+ * mm_free_space - Add up the free blocks of each segregated list into
+ *     bytes[0..LISTS-1] and return the size of the largest. It walks
+ *     every free list, so it takes time in the number of free blocks.
+ */
+size_t mm_free_space(size_t *bytes)
+{
+    char *bp;
+    size_t size, largest = 0;
+    int i;
+
+    mem_lock();
+    for (i = 0; i < LISTS; i++) {
+        bytes[i] = 0;
+        for (bp = LIST(i); bp != NULL; bp = PRED(bp)) {
+            size = GET_SIZE(HDRP(bp));
+            bytes[i] += size;
+            if (size > largest)
+                largest = size;
+        }
+    }
+    mem_unlock();
+    return largest;
+}
+
+/*
+ * mm_heap_map - Describe up to max blocks of the heap, in address order,
+ *     in blocks[]. Returns the number of blocks in the heap, which may be
+ *     more than max; the prologue and epilogue are left out.
+ */
+long mm_heap_map(mm_block_t *blocks, long max)
+{
+    char *bp;
+    size_t size;
+    long n = 0;
+    int list;
+
+    mem_lock();
+    for (bp = NEXT_BLKP(prologue_block); (size = GET_SIZE(HDRP(bp))) > 0;
+         bp = NEXT_BLKP(bp), n++) {
+        if (n >= max)
+            continue;
+        blocks[n].offset = HDRP(bp) - heap_base;
+        blocks[n].size = size;
+        blocks[n].flags = GET(HDRP(bp)) & 0x7;
+        for (list = 0; (list < LISTS - 1) && (size > 1); list++)
+            size >>= 1;
+        blocks[n].cls = list;
+        blocks[n].pad = 0;
+    }
+    mem_unlock();
+    return n;
+}
+
 /*
  * mm_checkheap - Check the heap for correctness
  */
 void mm_checkheap(int verbose)
 {
+    mem_lock();
     checkheap(verbose);
+    mem_unlock();
+}
+
+/*
+ * mm_halloc - Allocate a relocatable object of size bytes and return its
+ *     handle, or -1 on failure. The block carries its handle in the first
+ *     word so mm_compact can find the slot to update when it moves it.
+ */
+int mm_halloc(size_t size)
+{
+    char *bp;
+    int h;
+
+    if ((size == 0) || (size > MAX_REQUEST))
+        return -1;
+    mem_lock();
+    if (((root->hfree_slot < 0) && (grow_htable() < 0)) ||
+        ((bp = mm_malloc(size + DSIZE)) == NULL)) {
+        mem_unlock();
+        return -1;
+    }
+
+    h = root->hfree_slot;
+    root->hfree_slot = HTABLE[h].locks;
+    HTABLE[h].bp = TO_OFF(bp);
+    HTABLE[h].locks = 0;
+
+    PUT_NOTAG(bp, h);
+    PUT(HDRP(bp), GET(HDRP(bp)) | MOVABLE);
+    PUT(FTRP(bp), GET(FTRP(bp)) | MOVABLE);
+    mem_unlock();
+    return h;
+}
+
+/*
+ * mm_hlock - Pin the object and return the address of its payload, which
+ *     stays valid until the matching mm_hunlock
+ */
+void *mm_hlock(int h)
+{
+    char *p;
+
+    mem_lock();
+    HTABLE[h].locks++;
+    p = TO_PTR(HTABLE[h].bp) + DSIZE;
+    mem_unlock();
+    return p;
+}
+
+/*
+ * mm_hunlock - Undo one mm_hlock; the object may move once unpinned
+ */
+void mm_hunlock(int h)
+{
+    mem_lock();
+    if (HTABLE[h].locks > 0)
+        HTABLE[h].locks--;
+    mem_unlock();
+}
+
+/*
+ * mm_hfree - Free the object and recycle its handle
+ */
+void mm_hfree(int h)
+{
+    mem_lock();
+    mm_free(TO_PTR(HTABLE[h].bp));
+    HTABLE[h].bp = 0;
+    HTABLE[h].locks = root->hfree_slot;
+    root->hfree_slot = h;
+    mem_unlock();
+}
+
+/*
+ * mm_compact - Slide unlocked handle objects toward the low end of the
+ *     heap, then give the free space left at the top back with a negative
+ *     mem_sbrk. Blocks from mm_malloc and locked objects stay put. An
+ *     object sitting right above one of them cannot slide, so it is moved
+ *     into a lower free block that fits, if there is one. The handle
+ *     table moves like an object so it does not pin the top of the heap.
+ */
+void mm_compact(void)
+{
+    char *bp, *dst;
+    char *hole = NULL;   /* Free block right below bp, if any */
+    size_t bsize, hsize;
+    int h, table;
+
+    mem_lock();
+    for (bp = NEXT_BLKP(prologue_block); GET_SIZE(HDRP(bp)) > 0;
+         bp = NEXT_BLKP(bp)) {
+        if (!GET_ALLOC(HDRP(bp))) {
+            hole = bp;
+            continue;
+        }
+        table = (bp == (char *)HTABLE);
+        h = GET(bp);
+        if (!table && (!GET_MOVABLE(HDRP(bp)) || HTABLE[h].locks)) {
+            hole = NULL;
+            continue;
+        }
+        bsize = GET_SIZE(HDRP(bp));
+
+        if (hole == NULL) {
+            /* Pinned neighbour below: look for a lower block to move to */
+            if (((dst = find_fit(bsize)) == NULL) || (dst > bp))
+                continue;
+            place(dst, bsize);
+            memcpy(dst, bp, bsize - DSIZE);
+            if (table) {
+                root->htable = TO_OFF(dst);
+            } else {
+                PUT(HDRP(dst), GET(HDRP(dst)) | MOVABLE);
+                PUT(FTRP(dst), GET(FTRP(dst)) | MOVABLE);
+                HTABLE[h].bp = TO_OFF(dst);
+            }
+
+            /* The object's old block becomes a hole for the next one */
+            PUT(HDRP(bp), PACK(bsize, 0));
+            PUT(FTRP(bp), PACK(bsize, 0));
+            insert_node(bp, bsize);
+            hole = bp = coalesce(bp);
+            continue;
+        }
+
+        /* Swap the object and the hole below it */
+        hsize = GET_SIZE(HDRP(hole));
+        if (GET_DECOMMITTED(HDRP(hole)))
+            mem_recommit(hole, hsize);
+        delete_node(hole);
+        memmove(hole, bp, bsize - DSIZE);
+        PUT_NOTAG(HDRP(hole), PACK(bsize, table ? 1 : 1 | MOVABLE));
+        PUT_NOTAG(FTRP(hole), PACK(bsize, table ? 1 : 1 | MOVABLE));
+        if (table)
+            root->htable = TO_OFF(hole);
+        else
+            HTABLE[h].bp = TO_OFF(hole);
+
+        /* The hole now follows the object and may merge with what's next */
+        bp = NEXT_BLKP(hole);
+        PUT_NOTAG(HDRP(bp), PACK(hsize, 0));
+        PUT_NOTAG(FTRP(bp), PACK(hsize, 0));
+        insert_node(bp, hsize);
+        hole = bp = coalesce(bp);
+    }
+
+    trim_heap();
+    mem_unlock();
+}
+
+/*
+ * mm_region_create - Make an empty region. The region record is carved
+ *     from the front of the region's first chunk.
+ */
+mm_region_t *mm_region_create(void)
+{
+    char *chunk;
+    mm_region_t *r;
+
+    mem_lock();
+    if ((chunk = region_chunk(REGION_CHUNK)) == NULL) {
+        mem_unlock();
+        return NULL;
+    }
+    CHUNK_LINK(chunk) = 0;
+    r = (mm_region_t *)(chunk + DSIZE);
+    r->chunks = TO_OFF(chunk);
+    r->bump = r->chunks + DSIZE + ALIGN(sizeof(mm_region_t));
+    r->limit = r->chunks + GET_SIZE(HDRP(chunk)) - DSIZE;
+    mem_unlock();
+    return r;
+}
+
+/*
+ * mm_region_alloc - Bump-allocate size bytes from region r. A request
+ *     that does not fit starts a new chunk; one larger than a quarter of a
+ *     chunk gets a chunk of its own so the bump chunk is not abandoned.
+ */
+void *mm_region_alloc(mm_region_t *r, size_t size)
+{
+    void *bp;
+
+    mem_lock();
+    bp = region_alloc(r, size);
+    mem_unlock();
+    return bp;
+}
+
+/*
+ * region_alloc - mm_region_alloc with the heap lock held
+ */
+static void *region_alloc(mm_region_t *r, size_t size)
+{
+    size_t asize = ALIGN(size);
+    char *chunk, *bp;
+
+    if ((size == 0) || (size > MAX_REQUEST))
+        return NULL;
+
+    if (asize <= (size_t)(r->limit - r->bump)) {
+        bp = TO_PTR(r->bump);
+        r->bump += asize;
+        return bp;
+    }
+
+    if (asize > REGION_CHUNK / 4) {
+        /* Dedicated chunk, linked behind the bump chunk */
+        if ((chunk = region_chunk(asize)) == NULL)
+            return NULL;
+        CHUNK_LINK(chunk) = CHUNK_LINK(TO_PTR(r->chunks));
+        CHUNK_LINK(TO_PTR(r->chunks)) = TO_OFF(chunk);
+        return chunk + DSIZE;
+    }
+
+    if ((chunk = region_chunk(REGION_CHUNK)) == NULL)
+        return NULL;
+    CHUNK_LINK(chunk) = r->chunks;
+    r->chunks = TO_OFF(chunk);
+    r->bump = r->chunks + DSIZE + asize;
+    r->limit = r->chunks + GET_SIZE(HDRP(chunk)) - DSIZE;
+    return chunk + DSIZE;
+}
+
+/*
+ * mm_region_destroy - Free every chunk of region r, including the one
+ *     holding r itself. Chunks carved back to back coalesce into a few
+ *     large free blocks.
+ */
+void mm_region_destroy(mm_region_t *r)
+{
+    char *chunk, *next;
+
+    mem_lock();
+    for (chunk = TO_PTR(r->chunks); chunk != NULL; chunk = next) {
+        next = TO_PTR(CHUNK_LINK(chunk));
+        mm_free(chunk);
+    }
+    mem_unlock();
+}
+
+/*
+ * mm_snapshot - Write the heap image, which carries the allocator state
+ *     in its root, to path in a single writev. Returns 0 on success, -1
+ *     on error.
+ */
+int mm_snapshot(const char *path)
+{
+    static char hdr[SNAP_HDRSIZE];
+    snapshot_t *snap = (snapshot_t *)hdr;
+    struct iovec iov[2];
+    int fd, rc;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+
+    mem_lock();
+    memset(hdr, 0, SNAP_HDRSIZE);
+    snap->magic = SNAP_MAGIC;
+    snap->heapsize = mem_heapsize();
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = SNAP_HDRSIZE;
+    iov[1].iov_base = heap_base;
+    iov[1].iov_len = snap->heapsize;
+    rc = writev_all(fd, iov, 2);
+    mem_unlock();
+
+    if (close(fd) < 0)
+        rc = -1;
+    return rc;
+}
+
+/*
+ * mm_restore - Replace the current heap with the snapshot at path. The
+ *     image may land at a different base; only pointers the application
+ *     kept into the old heap are invalidated. Returns 0 or -1.
+ */
+int mm_restore(const char *path)
+{
+    snapshot_t snap;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    mem_lock();
+    if ((read(fd, &snap, sizeof(snap)) != sizeof(snap)) ||
+        (snap.magic != SNAP_MAGIC) ||
+        (snap.heapsize < ROOTSIZE + 4*WSIZE) ||
+        (mem_load(fd, SNAP_HDRSIZE, snap.heapsize) == (void *)-1)) {
+        mem_unlock();
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    heap_base = mem_heap_lo();
+    root = (root_t *)heap_base;
+    prologue_block = TO_PTR(root->prologue);
+    mem_unlock();
+    return 0;
 }
 
 /*
  * The remaining routines are internal helper routines
  */
 
+/*
+ * writev_all - writev that carries on after short writes
+ */
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        if ((n = writev(fd, iov, iovcnt)) < 0)
+            return -1;
+        while ((iovcnt > 0) && ((size_t)n >= iov->iov_len)) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * region_chunk - Carve a chunk with room for size bytes after its link
+ */
+static char *region_chunk(size_t size)
+{
+    return mm_malloc(size + DSIZE);
+}
+
+/*
+ * grow_htable - Double the handle table. The table is an ordinary block,
+ *     so handles (slot indices) survive the move.
+ */
+static int grow_htable(void)
+{
+    hslot_t *new_table, *old_table = HTABLE;
+    int new_cap = root->hcap ? 2 * root->hcap : HSLOTS;
+    int i;
+
+    if ((new_table = mm_malloc(new_cap * sizeof(hslot_t))) == NULL)
+        return -1;
+    if (old_table != NULL) {
+        memcpy(new_table, old_table, root->hcap * sizeof(hslot_t));
+        mm_free(old_table);
+    }
+    for (i = root->hcap; i < new_cap; i++) {
+        new_table[i].bp = 0;
+        new_table[i].locks = (i + 1 < new_cap) ? i + 1 : -1;
+    }
+    root->hfree_slot = root->hcap;
+    root->htable = TO_OFF(new_table);
+    root->hcap = new_cap;
+    return 0;
+}
+
+/*
+ * decommit_sweep - Release the interior pages of the large free blocks
+ *     that still hold theirs. The first payload words (list links) and the
+ *     footer stay put, so the block remains a normal free block and its
+ *     pages come back as they are touched.
+ */
+static void decommit_sweep(void)
+{
+    struct iovec iov[DECOMMIT_IOV];
+    char *bp;
+    size_t size;
+    int i, n = 0;
+
+    for (i = LISTS - 1; (i >= 0) && ((2UL << i) > DECOMMIT_MIN); i--) {
+        for (bp = LIST(i); bp != NULL; bp = PRED(bp)) {
+            size = GET_SIZE(HDRP(bp));
+            if ((size < DECOMMIT_MIN) || GET_DECOMMITTED(HDRP(bp)))
+                continue;
+            PUT(HDRP(bp), GET(HDRP(bp)) | DECOMMITTED);
+            PUT(FTRP(bp), GET(FTRP(bp)) | DECOMMITTED);
+            iov[n].iov_base = bp + DSIZE;
+            iov[n].iov_len = size - 2*DSIZE;
+            if (++n == DECOMMIT_IOV) {
+                mem_advisev(iov, n);
+                n = 0;
+            }
+        }
+    }
+    mem_advisev(iov, n);
+    decommit_pending = 0;
+    frees_since_sweep = 0;
+}
+
+/*
+ * trim_heap - Release a free block at the top of the heap to memlib
+ */
+static void trim_heap(void)
+{
+    char *epilogue = (char *)mem_heap_hi() + 1;
+    char *last = PREV_BLKP(epilogue);
+    size_t size = GET_SIZE(HDRP(last));
+
+    if (GET_ALLOC(HDRP(last)))
+        return;
+    delete_node(last);
+    PUT_NOTAG(HDRP(last), PACK(0, 1));  /* New epilogue header */
+    mem_sbrk(-(ptrdiff_t)size);
+}
+
 /*
  * extend_heap - Extend heap with free block and return its block pointer
  */
@@ -352,6 +1120,9 @@ static void *extend_heap(size_t size)
 
     asize = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
 
+    /* Offsets and block sizes are 32 bits, which caps the heap at 4 GB */
+    if (asize > MAX_HEAPSIZE - mem_heapsize())
+        return NULL;
     if ((long)(bp = mem_sbrk(asize)) == -1)
         return NULL;                                        //line:vm:mm:endextend
 
@@ -371,13 +1142,18 @@ static void place(void *bp, size_t asize)
 {
       size_t csize = GET_SIZE(HDRP(bp));
       size_t unallocated = csize - asize;
+      size_t dc = GET_DECOMMITTED(HDRP(bp));
       delete_node(bp);
 
+      /* The pages we hand out are in use again; the rest stay released */
+      if (dc)
+        mem_recommit(bp, (unallocated >= MINSIZE) ? asize : csize);
+
       if (unallocated >= MINSIZE) {
         PUT(HDRP(bp), PACK(asize, 1));
         PUT(FTRP(bp), PACK(asize, 1));
-        PUT_NOTAG(HDRP(NEXT_BLKP(bp)), PACK(unallocated, 0));
-        PUT_NOTAG(FTRP(NEXT_BLKP(bp)), PACK(unallocated, 0));
+        PUT_NOTAG(HDRP(NEXT_BLKP(bp)), PACK(unallocated, dc));
+        PUT_NOTAG(FTRP(NEXT_BLKP(bp)), PACK(unallocated, dc));
 	insert_node(NEXT_BLKP(bp),unallocated);
       }
       else {
@@ -389,15 +1165,20 @@ static void place(void *bp, size_t asize)
 
 static void insert_node(void *ptr, size_t size) {
   int list = 0;
+  size_t bits = size;
   void *search_ptr = ptr;
   void *insert_ptr = NULL;
 
-  /* Select segregated list */
-  while ((list < LISTS - 1) && (size > 1)) {
-    size >>= 1;
+  /* Select segregated list; size itself is kept for the sort below */
+  while ((list < LISTS - 1) && (bits > 1)) {
+    bits >>= 1;
     list++;
   }
-  search_ptr = free_lists[list];
+  if (root->policy == MM_ADDR_ORDERED) {
+    insert_by_addr(ptr, list);
+    return;
+  }
+  search_ptr = LIST(list);
   while ((search_ptr != NULL) && (size > GET_SIZE(HDRP(search_ptr)))) {
     insert_ptr = search_ptr;
     search_ptr = PRED(search_ptr);
@@ -416,7 +1197,7 @@ static void insert_node(void *ptr, size_t size) {
       SET_PTR(SUCC_PTR(ptr), NULL);
 
       /* Add block to appropriate list */
-      free_lists[list] = ptr;
+      SET_LIST(list, ptr);
     }
   } else {
     if (insert_ptr != NULL) {
@@ -428,10 +1209,62 @@ static void insert_node(void *ptr, size_t size) {
       SET_PTR(SUCC_PTR(ptr), NULL);
 
       /* Add block to appropriate list */
-      free_lists[list] = ptr;
+      SET_LIST(list, ptr);
+    }
+  }
+
+  return;
+}
+
+/*
+ * insert_by_addr: Link a free block into list in address order. The walk
+ *                 starts from the list's finger (the last block inserted)
+ *                 and moves toward lower or higher addresses, so frees with
+ *                 locality only touch a few neighbours instead of walking
+ *                 from the head every time.
+ */
+static void insert_by_addr(void *ptr, int list) {
+  char *lower = NULL;   /* Closest listed block below ptr (SUCC side) */
+  char *higher;         /* Closest listed block above ptr (PRED side) */
+  char *finger = FINGER(list);
+
+  higher = LIST(list);
+  if ((higher != NULL) && (higher < (char *)ptr)) {
+    if ((finger != NULL) && (finger < (char *)ptr)) {
+      lower = finger;
+      higher = PRED(finger);
+      while ((higher != NULL) && (higher < (char *)ptr)) {
+        lower = higher;
+        higher = PRED(higher);
+      }
+    } else {
+      if (finger != NULL) {
+        /* Walk down from the finger until we pass ptr */
+        higher = finger;
+        lower = SUCC(finger);
+        while (lower > (char *)ptr) {
+          higher = lower;
+          lower = SUCC(lower);
+        }
+      } else {
+        while ((higher != NULL) && (higher < (char *)ptr)) {
+          lower = higher;
+          higher = PRED(higher);
+        }
+      }
     }
   }
 
+  SET_PTR(SUCC_PTR(ptr), lower);
+  SET_PTR(PRED_PTR(ptr), higher);
+  if (lower != NULL)
+    SET_PTR(PRED_PTR(lower), ptr);
+  else
+    SET_LIST(list, ptr);
+  if (higher != NULL)
+    SET_PTR(SUCC_PTR(higher), ptr);
+
+  SET_FINGER(list, ptr);
   return;
 }
 
@@ -450,19 +1283,23 @@ static void delete_node(void *ptr) {
     list++;
   }
 
+  /* Keep the finger on a block that is still listed */
+  if (FINGER(list) == ptr)
+    SET_FINGER(list, (SUCC(ptr) != NULL) ? SUCC(ptr) : PRED(ptr));
+
   if (PRED(ptr) != NULL) {
     if (SUCC(ptr) != NULL) {
       SET_PTR(SUCC_PTR(PRED(ptr)), SUCC(ptr));
       SET_PTR(PRED_PTR(SUCC(ptr)), PRED(ptr));
     } else {
       SET_PTR(SUCC_PTR(PRED(ptr)), NULL);
-      free_lists[list] = PRED(ptr);
+      SET_LIST(list, PRED(ptr));
     }
   } else {
     if (SUCC(ptr) != NULL) {
       SET_PTR(PRED_PTR(SUCC(ptr)), NULL);
     } else {
-      free_lists[list] = NULL;
+      SET_LIST(list, NULL);
     }
   }
 
@@ -471,29 +1308,46 @@ static void delete_node(void *ptr) {
 
 
 /*
- * find_fit - Find a fit for a block with asize bytes
+ * find_fit - Find a fit for a block with asize bytes. With a fit budget
+ *            of K, look at up to K fitting blocks in the first class that
+ *            has one, keep the one with the least waste, and stop early
+ *            on an exact fit. Classes are disjoint ranges of sizes, so no
+ *            block in a later class can waste less. The budget only
+ *            matters for address-ordered lists: a size-ordered list's
+ *            first fit is already the tightest in its class.
  */
 
 static void *find_fit(size_t asize)
 {
-    char *oldrover = rover;
-    void *ptr = NULL;
-    int i;
+    char *ptr;
+    char *best = NULL;
+    size_t waste, best_waste = 0;
     size_t size = asize;
-    for (i = 0; i<LISTS; i++){
-      if ((i == LISTS - 1) || ((size<=1) && (free_lists[i] != NULL))){
-	ptr = free_lists[i];
-	while ((ptr!= NULL) && ((asize > GET_SIZE(HDRP(ptr))) || (GET_TAG(HDRP(ptr))))){
-	  ptr = PRED(ptr);
+    int i, seen = 0;
 
+    for (i = 0; i < LISTS; i++, size >>= 1) {
+      if ((i != LISTS - 1) && ((size > 1) || (LIST(i) == NULL)))
+	continue;
+      for (ptr = LIST(i); ptr != NULL; ptr = PRED(ptr)) {
+	// Ignore blocks that are too small or marked with the reallocation bit
+	if ((asize > GET_SIZE(HDRP(ptr))) || (GET_TAG(HDRP(ptr))))
+	  continue;
+	if ((fit_budget == 0) || (root->policy == MM_SIZE_ORDERED))
+	  return ptr;
+	waste = GET_SIZE(HDRP(ptr)) - asize;
+	if ((best == NULL) || (waste < best_waste)) {
+	  best = ptr;
+	  best_waste = waste;
+	  if (waste == 0)
+	    return best;
 	}
-	if (ptr!= NULL){
-	  break;
-	}
-      size >>= 1;
-    }
+	if (++seen >= fit_budget)
+	  return best;
+      }
+      if (best != NULL)
+	break;
     }
-    return ptr;
+    return best;
 }
 /* $end mmfirstfit */
 
@@ -501,7 +1355,6 @@ static void printblock(void *bp)
 {
     size_t hsize, halloc, fsize, falloc;
 
-    checkheap(0);
     hsize = GET_SIZE(HDRP(bp));
     halloc = GET_ALLOC(HDRP(bp));
     fsize = GET_SIZE(FTRP(bp));
@@ -524,7 +1377,7 @@ static void checkblock(void *bp)
     char *scan_ptr;
     if ((size_t)bp % 8)
         printf("Error: %p is not doubleword aligned\n", bp);
-    if (GET(HDRP(bp)) != GET(FTRP(bp)))
+    if ((GET(HDRP(bp)) & ~0x2) != (GET(FTRP(bp)) & ~0x2))
         printf("Error: header does not match footer\n");
     if (GET_SIZE(HDRP(bp)) != GET_SIZE(FTRP(bp))){
       printf("Error: header size does not match footer size");
@@ -534,16 +1387,16 @@ static void checkblock(void *bp)
     }
     if (!GET_ALLOC(HDRP(bp))){
       count_size= GET_SIZE(HDRP(bp));
-      while ((l<19) && (count_size >1)){
+      while ((l < LISTS - 1) && (count_size > 1)){
 	count_size >>= 1;
 	l++;
       }
-      scan_ptr = free_lists[l];
+      scan_ptr = LIST(l);
       while ((scan_ptr != NULL) && (scan_ptr != bp)) {
         scan_ptr = PRED(scan_ptr);
       }
       if (scan_ptr == NULL) {
-        printf("%d: There is a free block not in the list index\n");
+        printf("%p: There is a free block not in the list index\n", bp);
       }
 
     }
@@ -558,37 +1411,22 @@ void checkheap(int verbose)
   char *bp;
     // print value of
     if (verbose)
-        printf("Heap (%p):\n", heap_listp);
+        printf("Heap (%p):\n", prologue_block);
 
-    if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp))){
+    if ((GET_SIZE(HDRP(prologue_block)) != DSIZE) || !GET_ALLOC(HDRP(prologue_block))){
         printf("Bad prologue header\n");
-        checkblock(heap_listp);
+        checkblock(prologue_block);
     }
 
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+    for (bp = prologue_block; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
         if (verbose)
-	     printblock(bp);
-	     checkblock(bp);
+            printblock(bp);
+        checkblock(bp);
     }
 
     if (verbose)
       printblock(bp);
     if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
         printf("Bad epilogue header\n");
-    while (verbose) {
-
-
-
-
-    }
-
-
-
-
-
-
-
-
-
-
 }
+
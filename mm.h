@@ -4,6 +4,66 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_resize(void *ptr, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern size_t mm_usable_size(void *ptr);
+
+/* Free-list ordering policies for mm_set_policy */
+#define MM_SIZE_ORDERED 0  /* each class sorted by size (default) */
+#define MM_ADDR_ORDERED 1  /* each class sorted by address */
+
+extern void mm_set_policy(int policy);
+extern void mm_set_fit_budget(int k);
+
+/*
+ * Free space in each segregated class; class i holds the free blocks of
+ * 2^i to 2^(i+1)-1 bytes, and the last class everything bigger
+ */
+#define MM_CLASSES 20
+extern size_t mm_free_space(size_t *bytes);
+
+/* One block of the heap, as mm_heap_map describes it */
+typedef struct {
+    unsigned int offset;   /* of the block's header from mem_heap_lo() */
+    unsigned int size;     /* bytes, header and footer included */
+    unsigned char flags;   /* MM_BLOCK_xxx */
+    unsigned char cls;     /* segregated class of its size */
+    unsigned short pad;
+} mm_block_t;
+
+#define MM_BLOCK_ALLOC   0x1  /* allocated, else free */
+#define MM_BLOCK_TAG     0x2  /* free but held back for a realloc to grow */
+#define MM_BLOCK_MOVABLE 0x4  /* allocated: a handle object mm_compact may
+                                 move; free: its pages are released */
+
+extern long mm_heap_map(mm_block_t *blocks, long max);
+
+/* 
+ * Relocatable objects. Objects are reached through an int handle and
+ * may be moved by mm_compact unless locked.
+ */
+extern int mm_halloc(size_t size);
+extern void *mm_hlock(int h);
+extern void mm_hunlock(int h);
+extern void mm_hfree(int h);
+extern void mm_compact(void);
+
+/* Regions: bump-pointer arenas whose objects are all freed at once */
+typedef struct mm_region mm_region_t;
+
+extern mm_region_t *mm_region_create(void);
+extern void *mm_region_alloc(mm_region_t *r, size_t size);
+extern void mm_region_destroy(mm_region_t *r);
+
+/* Save the heap to a file and bring it back, e.g. for a warm start */
+extern int mm_snapshot(const char *path);
+extern int mm_restore(const char *path);
+
+/*
+ * Join a heap that another process created with mm_init in a shared
+ * mapping. Pass objects between processes as offsets from mem_heap_lo().
+ */
+extern int mm_attach(void);
 
 
 /* 
@@ -0,0 +1,621 @@
+/*
+ * mmcapture.c - An LD_PRELOAD library that records the malloc, calloc,
+ *     realloc and free calls of an unmodified program as a trace that
+ *     mdriver can replay:
+ *
+ *         unix> LD_PRELOAD=./libmmcapture.so MMCAPTURE_FILE=app.rep app
+ *
+ *     MMCAPTURE_FILE defaults to mmcapture.<pid>.rep, and MMCAPTURE_BINARY=1
+ *     writes a binary trace instead. Each allocation gets a fresh id; a
+ *     hash table maps the live pointers to their ids.
+ *
+ *     Recording is kept cheap for the calling threads. Each thread logs
+ *     its requests, stamped with a global sequence number, into a private
+ *     chunk that no other thread touches. A full chunk is pushed onto a
+ *     lock-free list, and a writer thread spills it to a file for that
+ *     thread. At exit the spill files, each already in sequence order,
+ *     are merged into the trace and the counts in its header filled in.
+ *     A program with several threads gets a threaded trace that mdriver
+ *     -T can replay: a t line wherever the thread changes, and whenever
+ *     a block passes from one thread to another, its last thread posts
+ *     an event (s) that the next one waits for (w) before touching it.
+ *
+ *     Blocks from memalign and friends, or from before the library was
+ *     loaded, are not known to it, so freeing them is not recorded and
+ *     reallocating one is recorded as a malloc. Requests of size 0 or of
+ *     more than INT_MAX bytes are not recorded either. The trace is
+ *     written by a destructor, so a program that leaves by _exit or a
+ *     fatal signal leaves no trace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tracefmt.h"
+
+#define CAP_CHUNK    65536  /* requests per chunk */
+#define CAP_THREADS  4096   /* max threads that can record */
+#define CAP_BUCKETS  (1 << 20) /* buckets of the pointer table */
+#define CAP_LOCKS    4096   /* locks striped over the buckets */
+#define CAP_WAKE     1000   /* us the writer sleeps between spills */
+#define CAP_NODES    4096   /* pointer table entries allocated at a time */
+
+/* glibc's own allocator, under the names it keeps for wrappers like us */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+/* One recorded request */
+typedef struct {
+    unsigned long seq;      /* global order of the request */
+    int type;               /* ALLOC, FREE or REALLOC */
+    int id;
+    int size;
+} caprec_t;
+
+/* A chunk of requests from one thread */
+typedef struct chunk {
+    struct chunk *next;     /* on the list of full chunks */
+    int thread;             /* index of the recording thread */
+    int count;
+    caprec_t recs[CAP_CHUNK];
+} chunk_t;
+
+/* A live block in the pointer table */
+typedef struct node {
+    struct node *next;
+    void *ptr;
+    int id;
+} node_t;
+
+/* What the library knows about one recording thread */
+typedef struct {
+    chunk_t *chunk;         /* chunk being filled, NULL if none */
+    int busy;               /* inside a recording call */
+    FILE *spill;            /* spill file, opened by the writer */
+    node_t *free_nodes;     /* unused pointer table entries */
+} capthread_t;
+
+static int ready;                 /* set once capture_init is done */
+static int stopping;              /* set at exit and in forked children */
+static char out_path[PATH_MAX];
+static int out_binary;
+
+static unsigned long next_seq;    /* sequence number of the next request */
+static int next_id;               /* id of the next allocation */
+
+static capthread_t threads[CAP_THREADS];
+static int num_threads;
+static pthread_key_t thread_key;
+
+static chunk_t *full_chunks;      /* lock-free stack of full chunks */
+static pthread_t writer;
+
+static node_t **buckets;
+static char locks[CAP_LOCKS];
+
+/* The calling thread's record, and whether it is inside the library */
+static __thread int my_thread __attribute__((tls_model("initial-exec"))) = -1;
+static __thread int in_capture __attribute__((tls_model("initial-exec")));
+
+static void capture_init(void) __attribute__((constructor));
+static void capture_fini(void) __attribute__((destructor));
+static void capture_child(void);
+static void thread_gone(void *arg);
+static void *writer_main(void *arg);
+static void spill(chunk_t *list);
+static int begin(void);
+static void end(void);
+static void record(int type, int id, size_t size);
+static int new_block(size_t size);
+static void put_ptr(void *ptr, int id);
+static int take_ptr(void *ptr);
+static void merge(void);
+static void put_sync(FILE *fp, int type, int n, uint32_t *index, 
+		     uint32_t *num_ops);
+
+/*
+ * The interposed functions. Calls made while the library is working,
+ * or before it is set up, go straight to glibc.
+ */
+void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+
+    if (p != NULL && begin()) {
+	if (size > 0 && size <= INT_MAX)
+	    put_ptr(p, new_block(size));
+	end();
+    }
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p = __libc_calloc(nmemb, size);
+
+    if (p != NULL && begin()) {
+	if (nmemb * size > 0 && nmemb * size <= INT_MAX)
+	    put_ptr(p, new_block(nmemb * size));
+	end();
+    }
+    return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+    int id = -1;
+
+    if (!begin())
+	return __libc_realloc(ptr, size);
+
+    if (ptr != NULL && (id = take_ptr(ptr)) >= 0 && size == 0)
+	record(FREE, id, 0);
+    p = __libc_realloc(ptr, size);
+    if (p != NULL && size > 0 && size <= INT_MAX) {
+	if (id >= 0) {
+	    record(REALLOC, id, size);
+	    put_ptr(p, id);
+	}
+	else
+	    put_ptr(p, new_block(size));
+    }
+    else if (p == NULL && id >= 0 && size > 0)
+	put_ptr(ptr, id);  /* failed, so ptr is still live */
+    end();
+    return p;
+}
+
+void free(void *ptr)
+{
+    int id;
+
+    if (ptr != NULL && begin()) {
+	if ((id = take_ptr(ptr)) >= 0)
+	    record(FREE, id, 0);
+	end();
+    }
+    __libc_free(ptr);
+}
+
+/*
+ * capture_init - Work out where the trace goes and start the writer
+ */
+static void capture_init(void)
+{
+    char *s, cwd[PATH_MAX];
+
+    /* The program may change directory before the trace is written */
+    in_capture = 1;
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+	strcpy(cwd, ".");
+    if ((s = getenv("MMCAPTURE_FILE")) != NULL && *s == '/')
+	snprintf(out_path, sizeof(out_path), "%s", s);
+    else if (s != NULL && *s != '\0')
+	snprintf(out_path, sizeof(out_path), "%s/%s", cwd, s);
+    else
+	snprintf(out_path, sizeof(out_path), "%s/mmcapture.%d.rep", cwd,
+		 (int)getpid());
+    out_binary = ((s = getenv("MMCAPTURE_BINARY")) != NULL && atoi(s) != 0);
+
+    buckets = (node_t **)mmap(NULL, CAP_BUCKETS * sizeof(node_t *),
+			      PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buckets == MAP_FAILED ||
+	pthread_key_create(&thread_key, thread_gone) != 0 ||
+	pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+	fprintf(stderr, "mmcapture: could not start, not recording\n");
+	in_capture = 0;
+	return;
+    }
+    pthread_atfork(NULL, NULL, capture_child);
+    __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+    in_capture = 0;
+}
+
+/*
+ * capture_fini - Stop recording, wait for the threads caught in the
+ *     middle of a request, spill the last chunks and write the trace
+ */
+static void capture_fini(void)
+{
+    int t, n;
+
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE) || stopping)
+	return;
+    in_capture = 1;
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+    n = __atomic_load_n(&num_threads, __ATOMIC_ACQUIRE);
+    if (n > CAP_THREADS)
+	n = CAP_THREADS;
+    for (t = 0; t < n; t++)
+	while (__atomic_load_n(&threads[t].busy, __ATOMIC_ACQUIRE))
+	    sched_yield();
+    pthread_join(writer, NULL);
+
+    /* Chunks filled after the writer's last look, then the partial ones */
+    if (full_chunks != NULL)
+	spill(full_chunks);
+    for (t = 0; t < n; t++) {
+	if (threads[t].chunk != NULL) {
+	    threads[t].chunk->next = NULL;
+	    spill(threads[t].chunk);
+	    threads[t].chunk = NULL;
+	}
+    }
+    merge();
+}
+
+/* capture_child - A forked child neither records nor writes the trace */
+static void capture_child(void)
+{
+    stopping = 1;
+}
+
+/*
+ * thread_gone - Hand the chunk of an exiting thread to the writer
+ */
+static void thread_gone(void *arg)
+{
+    capthread_t *ct = (capthread_t *)arg;
+    chunk_t *c = ct->chunk;
+
+    if (c == NULL)
+	return;
+    ct->chunk = NULL;
+    c->next = __atomic_load_n(&full_chunks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&full_chunks, &c->next, c, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
+}
+
+/*
+ * writer_main - Body of the writer thread, which spills full chunks
+ *     until the program exits
+ */
+static void *writer_main(void *arg)
+{
+    chunk_t *list;
+    int last = 0;
+
+    in_capture = 1;
+    while (!last) {
+	last = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+	list = __atomic_exchange_n(&full_chunks, NULL, __ATOMIC_ACQUIRE);
+	if (list != NULL)
+	    spill(list);
+	else if (!last)
+	    usleep(CAP_WAKE);
+    }
+    return NULL;
+}
+
+/*
+ * spill - Append a list of chunks, newest first as the stack hands them
+ *     over, to the spill files of their threads, and free them
+ */
+static void spill(chunk_t *list)
+{
+    chunk_t *prev = NULL, *next;
+    capthread_t *ct;
+    char path[PATH_MAX + 32];
+
+    for (; list != NULL; list = next) {  /* oldest first */
+	next = list->next;
+	list->next = prev;
+	prev = list;
+    }
+    for (list = prev; list != NULL; list = next) {
+	next = list->next;
+	ct = &threads[list->thread];
+	if (ct->spill == NULL) {
+	    snprintf(path, sizeof(path), "%s.%d", out_path, list->thread);
+	    if ((ct->spill = fopen(path, "w+")) == NULL) {
+		fprintf(stderr, "mmcapture: could not create %s: %s\n",
+			path, strerror(errno));
+		exit(1);
+	    }
+	    unlink(path);
+	}
+	if (fwrite(list->recs, sizeof(caprec_t), list->count, ct->spill) !=
+	    (size_t)list->count) {
+	    fprintf(stderr, "mmcapture: could not spill: %s\n", strerror(errno));
+	    exit(1);
+	}
+	munmap(list, sizeof(chunk_t));
+    }
+}
+
+/*
+ * begin - Start recording a request on the calling thread. Returns 0 if
+ *     it should not be recorded, e.g. because the library made the call.
+ */
+static int begin(void)
+{
+    int t;
+
+    if (in_capture || !__atomic_load_n(&ready, __ATOMIC_ACQUIRE))
+	return 0;
+    in_capture = 1;
+    if ((t = my_thread) < 0) {
+	if ((t = __atomic_fetch_add(&num_threads, 1, __ATOMIC_ACQ_REL)) >=
+	    CAP_THREADS) {
+	    fprintf(stderr, "mmcapture: more than %d threads, "
+		    "not recording the rest\n", CAP_THREADS);
+	    in_capture = 0;
+	    return 0;
+	}
+	my_thread = t;
+	pthread_setspecific(thread_key, &threads[t]);
+    }
+    __atomic_store_n(&threads[t].busy, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)) {
+	__atomic_store_n(&threads[t].busy, 0, __ATOMIC_RELEASE);
+	in_capture = 0;
+	return 0;
+    }
+    return 1;
+}
+
+/* end - Finish a request started by begin */
+static void end(void)
+{
+    __atomic_store_n(&threads[my_thread].busy, 0, __ATOMIC_RELEASE);
+    in_capture = 0;
+}
+
+/*
+ * record - Log a request in the calling thread's chunk, handing the
+ *     chunk to the writer once it is full
+ */
+static void record(int type, int id, size_t size)
+{
+    capthread_t *ct = &threads[my_thread];
+    chunk_t *c = ct->chunk;
+    caprec_t *r;
+
+    if (c == NULL) {
+	c = (chunk_t *)mmap(NULL, sizeof(chunk_t), PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (c == MAP_FAILED) {
+	    fprintf(stderr, "mmcapture: out of memory\n");
+	    exit(1);
+	}
+	c->thread = my_thread;
+	c->count = 0;
+	ct->chunk = c;
+	pthread_setspecific(thread_key, ct);
+    }
+    r = &c->recs[c->count++];
+    r->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+    r->type = type;
+    r->id = id;
+    r->size = (int)size;
+
+    if (c->count == CAP_CHUNK) {
+	ct->chunk = NULL;
+	c->next = __atomic_load_n(&full_chunks, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&full_chunks, &c->next, c, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	    ;
+    }
+}
+
+/*
+ * new_block - Give a new allocation the next id and record it. This is
+ *     done after glibc returns the block, so it is ordered after the
+ *     free of any earlier block at the same address.
+ */
+static int new_block(size_t size)
+{
+    int id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+
+    record(ALLOC, id, size);
+    return id;
+}
+
+/* Hash of a pointer, and the lock of its bucket */
+#define BUCKET(p)  ((unsigned)(((unsigned long)(p) >> 4) * 0x9E3779B97F4A7C15UL \
+			       >> 44) & (CAP_BUCKETS - 1))
+#define LOCK(b)    (&locks[(b) & (CAP_LOCKS - 1)])
+
+static inline void lock_bucket(unsigned b)
+{
+    while (__atomic_test_and_set(LOCK(b), __ATOMIC_ACQUIRE))
+	while (__atomic_load_n(LOCK(b), __ATOMIC_RELAXED))
+	    sched_yield();  /* the holder may have been preempted */
+}
+
+static inline void unlock_bucket(unsigned b)
+{
+    __atomic_clear(LOCK(b), __ATOMIC_RELEASE);
+}
+
+/*
+ * put_ptr - Enter a live block in the table. Entries come from the
+ *     calling thread's free list, which is filled CAP_NODES at a time
+ *     from mmap rather than glibc, so recording adds no mallocs.
+ */
+static void put_ptr(void *ptr, int id)
+{
+    capthread_t *ct = &threads[my_thread];
+    node_t *n;
+    unsigned b = BUCKET(ptr);
+    int i;
+
+    if (ct->free_nodes == NULL) {
+	n = (node_t *)mmap(NULL, CAP_NODES * sizeof(node_t), 
+			   PROT_READ | PROT_WRITE, 
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (n == MAP_FAILED)
+	    return;
+	for (i = 0; i < CAP_NODES; i++)
+	    n[i].next = (i + 1 < CAP_NODES) ? &n[i + 1] : NULL;
+	ct->free_nodes = n;
+    }
+    n = ct->free_nodes;
+    ct->free_nodes = n->next;
+    n->ptr = ptr;
+    n->id = id;
+    lock_bucket(b);
+    n->next = buckets[b];
+    buckets[b] = n;
+    unlock_bucket(b);
+}
+
+/*
+ * take_ptr - Remove a block from the table, putting its entry on the
+ *     calling thread's free list. Returns its id, or -1 if the block is
+ *     not known.
+ */
+static int take_ptr(void *ptr)
+{
+    node_t **np, *n;
+    unsigned b = BUCKET(ptr);
+    int id = -1;
+
+    lock_bucket(b);
+    for (np = &buckets[b]; (n = *np) != NULL; np = &n->next) {
+	if (n->ptr == ptr) {
+	    *np = n->next;
+	    id = n->id;
+	    break;
+	}
+    }
+    unlock_bucket(b);
+    if (n != NULL) {
+	n->next = threads[my_thread].free_nodes;
+	threads[my_thread].free_nodes = n;
+    }
+    return id;
+}
+
+/*
+ * merge - Merge the spill files of the threads, each in sequence order,
+ *     into the trace, with the thread and event records that -T needs
+ *     to replay it on threads. The header is written again at the end,
+ *     once the counts are known.
+ */
+static void merge(void)
+{
+    caprec_t *next[CAP_THREADS];
+    FILE *fp;
+    tracehdr_t hdr;
+    traceop_t op;
+    caprec_t *recs[CAP_THREADS];
+    size_t lens[CAP_THREADS];
+    uint32_t index = 0, num_ops = 0;
+    int *last = NULL;     /* thread that last used each id, plus one */
+    int cur = 0;          /* thread of the last record written */
+    int events = 0;
+    int t, u, best, n = num_threads;
+
+    if (n > CAP_THREADS)
+	n = CAP_THREADS;
+    for (t = 0; t < n; t++) {
+	recs[t] = next[t] = NULL;
+	lens[t] = 0;
+	if (threads[t].spill == NULL || fflush(threads[t].spill) != 0)
+	    continue;
+	lens[t] = ftell(threads[t].spill);
+	if (lens[t] == 0)
+	    continue;
+	recs[t] = (caprec_t *)mmap(NULL, lens[t], PROT_READ, MAP_PRIVATE,
+				   fileno(threads[t].spill), 0);
+	if (recs[t] == MAP_FAILED) {
+	    fprintf(stderr, "mmcapture: could not map a spill file: %s\n",
+		    strerror(errno));
+	    return;
+	}
+	madvise(recs[t], lens[t], MADV_SEQUENTIAL);
+	next[t] = recs[t];
+    }
+
+    if ((n > 1) && (next_id > 0) &&
+	(last = (int *)__libc_calloc(next_id, sizeof(int))) == NULL) {
+	fprintf(stderr, "mmcapture: out of memory\n");
+	return;
+    }
+    if ((fp = fopen(out_path, "w")) == NULL) {
+	fprintf(stderr, "mmcapture: could not create %s: %s\n", out_path,
+		strerror(errno));
+	return;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    trace_put_header(fp, &hdr, out_binary, 1);
+
+    op.region = 0;
+    for (;;) {
+	/* There are few threads as a rule, so a scan beats a heap */
+	best = -1;
+	for (t = 0; t < n; t++)
+	    if (next[t] != NULL &&
+		(best < 0 || next[t]->seq < next[best]->seq))
+		best = t;
+	if (best < 0)
+	    break;
+	op.type = next[best]->type;
+	op.index = next[best]->id;
+	op.size = next[best]->size;
+	if (last != NULL) {
+	    /* Hand a block another thread used over to this one */
+	    if ((u = last[op.index] - 1) >= 0 && u != best) {
+		if (cur != u)
+		    put_sync(fp, THREAD, u, &index, &num_ops);
+		put_sync(fp, POST, events, &index, &num_ops);
+		put_sync(fp, THREAD, best, &index, &num_ops);
+		put_sync(fp, WAIT, events++, &index, &num_ops);
+		cur = best;
+	    }
+	    if (cur != best)
+		put_sync(fp, THREAD, best, &index, &num_ops);
+	    cur = best;
+	    last[op.index] = best + 1;
+	}
+	trace_put_op(fp, &op, &index, out_binary);
+	num_ops++;
+	if ((char *)++next[best] == (char *)recs[best] + lens[best])
+	    next[best] = NULL;
+    }
+
+    hdr.num_ids = next_id;
+    hdr.num_ops = num_ops;
+    hdr.weight = 1;
+    rewind(fp);
+    trace_put_header(fp, &hdr, out_binary, 1);
+    if (ferror(fp) || fclose(fp) != 0)
+	fprintf(stderr, "mmcapture: could not write %s: %s\n", out_path,
+		strerror(errno));
+
+    for (t = 0; t < n; t++) {
+	if (recs[t] != NULL)
+	    munmap(recs[t], lens[t]);
+	if (threads[t].spill != NULL)
+	    fclose(threads[t].spill);
+    }
+    __libc_free(last);
+}
+
+/* put_sync - Write a THREAD, POST or WAIT record for thread or event n */
+static void put_sync(FILE *fp, int type, int n, uint32_t *index, 
+		     uint32_t *num_ops)
+{
+    traceop_t op;
+
+    op.type = type;
+    op.index = n;
+    op.size = 0;
+    op.region = 0;
+    trace_put_op(fp, &op, index, out_binary);
+    (*num_ops)++;
+}
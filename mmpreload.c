@@ -0,0 +1,258 @@
+/*
+ * mmpreload.c - Run real programs on the mm package. Built into
+ *     libmm.so along with mm.c and memlib.c, it takes the place of the
+ *     C library's malloc when preloaded:
+ *
+ *         unix> LD_PRELOAD=./libmm.so program
+ *
+ *     The heap is a private memlib heap whose pages are committed with
+ *     mmap as it grows. It is set up by the first allocation; neither
+ *     memlib nor mm call the C library's malloc, so that is safe however
+ *     early it comes. mem_set_threads makes the heap safe for threads.
+ *
+ *     MM_HEAP_MB sets the heap's capacity (default and most 4095 MB,
+ *     as far as mm's heap offsets reach), MM_HUGE_PAGES=1 backs it with
+ *     huge pages, and MM_STATS=1 prints the heap size and RSS at exit.
+ *
+ *     Blocks are MM_ALIGN aligned, as the ABI expects of malloc. Pointers
+ *     that did not come from the heap are ignored by free, so blocks the
+ *     dynamic linker allocated before the library was loaded do no harm.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MM_ALIGN     16                 /* alignment of every block */
+#define MM_MAX_MB    4095               /* largest heap mm can address */
+
+#define EXPORT __attribute__((visibility("default")))
+
+static int ready;                       /* is the heap set up? */
+static size_t heap_max;                 /* its capacity in bytes */
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void heap_init(void);
+static void heap_stats(void);
+static void before_fork(void);
+static void after_fork(void);
+static void after_fork_child(void);
+static int from_heap(void *ptr);
+static void *heap_alloc(size_t align, size_t size);
+
+/* Set up the heap on first use */
+#define READY() (ready || (pthread_once(&once, heap_init), ready))
+
+/*
+ * The C library's allocation functions, in terms of mm
+ */
+EXPORT void *malloc(size_t size)
+{
+    return heap_alloc(MM_ALIGN, size);
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr != NULL && ready && from_heap(ptr))
+	mm_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (size && nmemb > SIZE_MAX / size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if ((p = heap_alloc(MM_ALIGN, nmemb * size)) != NULL)
+	memset(p, 0, nmemb * size);
+    return p;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    void *p;
+    size_t old;
+
+    if (ptr == NULL || !ready || !from_heap(ptr))
+	return heap_alloc(MM_ALIGN, size);
+    if (size == 0) {
+	mm_free(ptr);
+	return NULL;
+    }
+    if (size > heap_max) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    /* 
+     * mm_realloc would move the block to wherever mm_malloc puts it,
+     * which may be only 8 byte aligned, so a block that has to move is
+     * moved here instead. On failure ptr is left as it was.
+     */
+    if ((p = mm_resize(ptr, size)) != NULL)
+	return p;
+    if ((p = heap_alloc(MM_ALIGN, size)) == NULL)
+	return NULL;
+    old = mm_usable_size(ptr);
+    memcpy(p, ptr, old < size ? old : size);
+    mm_free(ptr);
+    return p;
+}
+
+EXPORT void *memalign(size_t align, size_t size)
+{
+    if (align & (align - 1)) {
+	errno = EINVAL;
+	return NULL;
+    }
+    return heap_alloc(align < MM_ALIGN ? MM_ALIGN : align, size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *p;
+
+    if ((align % sizeof(void *)) || (align & (align - 1)))
+	return EINVAL;
+    if ((p = memalign(align, size)) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    if (size > SIZE_MAX - page) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL || !ready || !from_heap(ptr))
+	return 0;
+    return mm_usable_size(ptr);
+}
+
+/*
+ * heap_alloc - Allocate an aligned block. Everything allocates through
+ *     here rather than malloc: the compiler knows what malloc does and
+ *     may turn malloc followed by memset into a call to calloc, which
+ *     would then call itself. A block from mm_malloc that happens to be
+ *     aligned is kept; only the others pay for mm_memalign, which
+ *     allocates size + align bytes and splits off both ends. A request
+ *     the heap could never hold fails here, before mm rounds its size.
+ */
+static void *heap_alloc(size_t align, size_t size)
+{
+    void *p;
+
+    if (!READY())
+	return NULL;
+    if (size == 0)
+	size = 1;
+    if (size > heap_max || align > heap_max - size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if ((align <= MM_ALIGN) && ((p = mm_malloc(size)) != NULL)) {
+	if (((uintptr_t)p & (MM_ALIGN - 1)) == 0)
+	    return p;
+	mm_free(p);
+    }
+    if ((p = mm_memalign(align, size)) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+/*
+ * heap_init - Reserve and set up the heap. Nothing here may call malloc.
+ */
+static void heap_init(void)
+{
+    char *s;
+    long mb = MM_MAX_MB;
+
+    if ((s = getenv("MM_HEAP_MB")) != NULL && atol(s) > 0 &&
+	atol(s) < MM_MAX_MB)
+	mb = atol(s);
+    heap_max = (size_t)mb << 20;
+    mem_set_max_heap(heap_max);
+    if ((s = getenv("MM_HUGE_PAGES")) != NULL && atoi(s))
+	mem_set_huge_pages(1);
+    mem_set_threads(1);
+    mem_init();
+    if (mm_init() < 0) {
+	fprintf(stderr, "libmm: mm_init failed\n");
+	abort();
+    }
+    ready = 1;
+
+    /* These may allocate, which is fine now that the heap is ready */
+    pthread_atfork(before_fork, after_fork, after_fork_child);
+    if ((s = getenv("MM_STATS")) != NULL && atoi(s))
+	atexit(heap_stats);
+}
+
+/*
+ * heap_stats - Report on the heap at exit (MM_STATS)
+ */
+static void heap_stats(void)
+{
+    mem_lock();
+    fprintf(stderr, "libmm: heap %zu KB, peak %zu KB, rss %zu KB, "
+	    "peak rss %zu KB\n", mem_heapsize() >> 10,
+	    mem_peak_heapsize() >> 10, mem_rss() >> 10, mem_peak_rss() >> 10);
+    mem_unlock();
+}
+
+/*
+ * before_fork, after_fork, after_fork_child - Hold the heap lock across
+ *     fork, so the child does not inherit it in the middle of another
+ *     thread's call. The child's thread is not the one that took the lock
+ *     and cannot unlock it, so it sets up a fresh one instead.
+ */
+static void before_fork(void)
+{
+    mem_lock();
+}
+
+static void after_fork(void)
+{
+    mem_unlock();
+}
+
+static void after_fork_child(void)
+{
+    mem_set_threads(0);
+    mem_set_threads(1);
+}
+
+/* from_heap - Is ptr inside the heap? */
+static int from_heap(void *ptr)
+{
+    return (char *)ptr > (char *)mem_heap_lo() &&
+	(char *)ptr <= (char *)mem_heap_hi();
+}
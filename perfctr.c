@@ -0,0 +1,116 @@
+/*
+ * perfctr.c - Count hardware events with perf_event_open (Linux only)
+ *
+ * Each counter is opened on its own rather than as a group, so that the
+ * counters the kernel can open are used even when others fail. If there
+ * are more counters than the PMU has registers, the kernel multiplexes
+ * them, and each count is scaled by the time it was enabled over the
+ * time it was actually counting.
+ *
+ * A counter counts the thread that opened it, so a process forked after
+ * perf_init (an mdriver -j worker) opens its own on its first perf_start.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perfctr.h"
+
+/* Cache events are encoded as cache | op << 8 | result << 16 */
+#define CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static struct {
+    char *name;
+    unsigned type;
+    unsigned long long config;
+} events[PERF_EVENTS] = {
+    {"cycles",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instrs",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1D-miss", PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {"LLC-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"dTLB-miss",PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {"br-miss",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"faults",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+static int fds[PERF_EVENTS];
+static pid_t owner = 0;    /* process the counters count */
+
+/* Open the counters for the calling process */
+static int perf_open(int verbose)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    for (i = 0; i < PERF_EVENTS; i++) {
+	if (owner != 0 && fds[i] >= 0)
+	    close(fds[i]);
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    n++;
+	else if (verbose)
+	    printf("Counter %s not available: %s\n", events[i].name,
+		   strerror(errno));
+    }
+    owner = getpid();
+    return n;
+}
+
+int perf_init(int verbose)
+{
+    return perf_open(verbose);
+}
+
+const char *perf_name(int i)
+{
+    return events[i].name;
+}
+
+int perf_available(int i)
+{
+    return fds[i] >= 0;
+}
+
+void perf_start(void)
+{
+    int i;
+
+    if (owner != getpid())
+	perf_open(0);
+    for (i = 0; i < PERF_EVENTS; i++)
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+void perf_stop(double *counts)
+{
+    unsigned long long v[3];  /* count, time enabled, time running */
+    int i;
+
+    for (i = 0; i < PERF_EVENTS; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    for (i = 0; i < PERF_EVENTS; i++) {
+	counts[i] = -1;
+	if (fds[i] < 0 || read(fds[i], v, sizeof(v)) != sizeof(v))
+	    continue;
+	counts[i] = (v[2] == 0) ? 0 : (double)v[0] * v[1] / v[2];
+    }
+}
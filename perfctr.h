@@ -0,0 +1,26 @@
+/*
+ * perfctr.h - Hardware performance counters, read with perf_event_open
+ *
+ * The counters count this process in user mode only. Any counter the
+ * kernel won't open (no PMU, as in many VMs and containers, or too
+ * strict a perf_event_paranoid) is simply left out.
+ */
+#define PERF_EVENTS 7    /* cycles, instructions, L1D, LLC and dTLB misses,
+			    branch misses, page faults */
+
+/* Open the counters; return how many of them could be opened */
+int perf_init(int verbose);
+
+/* Short name of counter i */
+const char *perf_name(int i);
+
+/* Could counter i be opened? */
+int perf_available(int i);
+
+/* Zero and start the counters */
+void perf_start(void);
+
+/* Stop the counters and set counts[i] to what counter i counted, scaled
+   up if the kernel had to share the hardware among counters, or to -1 if
+   it isn't available */
+void perf_stop(double *counts);
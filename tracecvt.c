@@ -0,0 +1,64 @@
+/*
+ * tracecvt.c - Convert a trace between the text (.rep) format and the
+ *     packed binary format, which mdriver maps straight into memory
+ *     instead of parsing. The output takes the format the input is not.
+ *     The trace is streamed, so it need not fit in memory.
+ *
+ *     usage: tracecvt <infile> <outfile>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tracefmt.h"
+
+int main(int argc, char **argv)
+{
+    tracestream_t ts;
+    tracehdr_t hdr;
+    traceop_t *ops;
+    FILE *fp;
+    uint32_t index = 0;
+    int i, n, binary;
+
+    if (argc != 3) {
+	fprintf(stderr, "Usage: tracecvt <infile> <outfile>\n");
+	fprintf(stderr, "\tA text trace becomes binary, a binary one text.\n");
+	exit(1);
+    }
+    if (trace_stream_open(argv[1], &ts) < 0)
+	exit(1);
+    if ((fp = fopen(argv[2], "w")) == NULL) {
+	fprintf(stderr, "Could not create %s: %s\n", argv[2], strerror(errno));
+	exit(1);
+    }
+
+    /* 
+     * A text header has no region count, so count the regions on the
+     * way and write the binary header again at the end
+     */
+    hdr = ts.hdr;
+    binary = !ts.binary;
+    trace_put_header(fp, &hdr, binary, 0);
+    while ((n = trace_stream_next(&ts, &ops)) > 0) {
+	for (i = 0; i < n; i++) {
+	    if (TRACE_HAS_REGION(ops[i].type) && 
+		(uint32_t)ops[i].region >= hdr.num_regions)
+		hdr.num_regions = ops[i].region + 1;
+	    trace_put_op(fp, &ops[i], &index, binary);
+	}
+    }
+    trace_stream_close(&ts);
+    if (n < 0)
+	exit(1);
+    if (binary) {
+	rewind(fp);
+	trace_put_header(fp, &hdr, binary, 0);
+    }
+    if (ferror(fp) || fclose(fp) != 0) {
+	fprintf(stderr, "Could not write %s: %s\n", argv[2], strerror(errno));
+	exit(1);
+    }
+    return 0;
+}
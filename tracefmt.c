@@ -0,0 +1,665 @@
+/*
+ * tracefmt.c - Read and write trace files in either format.
+ *
+ * A text (.rep) trace has four header lines (suggested heap size,
+ * number of ids, number of ops, weight) followed by one request per
+ * line:
+ *     a <id> <size>     mm_malloc
+ *     r <id> <size>     mm_realloc
+ *     f <id>            mm_free (or mm_hfree for a handle object)
+ *     h <id> <size>     mm_halloc, a relocatable object
+ *     c                 mm_compact
+ *     n <r>             mm_region_create
+ *     b <r> <id> <size> mm_region_alloc from region r
+ *     d <r>             mm_region_destroy, which frees all its blocks
+ *     t <thread>        the ops that follow run on thread <thread>
+ *     s <event>         post event <event> ...
+ *     w <event>         ... which this thread must wait for
+ *
+ * A trace without t lines runs on thread 0. Posting an event and waiting
+ * for it orders ops of different threads, e.g. a malloc on one thread
+ * before a free of the same block on another. The file order must be a
+ * valid order to run the ops in, so the serial evaluations of mdriver
+ * simply skip the t, s and w lines.
+ *
+ * A binary trace is a tracehdr_t followed by the packed ops described
+ * in tracefmt.h. Most ops pack into two or three bytes, and loading one
+ * is a single mmap plus one pass to check that the ops are well formed.
+ *
+ * A trace too big to hold in memory can instead be streamed: a reader
+ * thread decodes it TRACE_CHUNK ops at a time into one of two buffers
+ * while the caller works through the other.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE 1024 /* max string size */
+
+static int read_rep_op(FILE *fp, const char *path, traceop_t *op);
+static int read_rep_header(FILE *fp, const char *path, tracehdr_t *hdr);
+static int read_rep(const char *path, tracefile_t *tf);
+static int map_bin(const char *path, tracefile_t *tf);
+static int read_bin_op(FILE *fp, uint32_t *index, traceop_t *op);
+static int fill_chunk(tracestream_t *ts, traceop_t *ops);
+static void *stream_reader(void *arg);
+static const unsigned char *get_varint(const unsigned char *p,
+				       const unsigned char *end, uint32_t *v);
+static int get_varint_fp(FILE *fp, uint32_t *v);
+static void put_varint(FILE *fp, uint32_t v);
+
+/*
+ * trace_is_binary - Return 1 if the file at path starts with the magic
+ *     number of a binary trace, 0 if not, and -1 if it can't be read
+ */
+int trace_is_binary(const char *path)
+{
+    char magic[sizeof(TRACE_MAGIC)];
+    int fd;
+    ssize_t n;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return -1;
+    n = read(fd, magic, sizeof(magic));
+    close(fd);
+    if (n < 0)
+	return -1;
+    return (n == sizeof(magic)) && !memcmp(magic, TRACE_MAGIC, sizeof(magic));
+}
+
+/*
+ * trace_open - Open the trace at path, whichever its format. Returns 0,
+ *     or -1 after printing why the trace could not be opened.
+ */
+int trace_open(const char *path, tracefile_t *tf)
+{
+    int binary;
+
+    memset(tf, 0, sizeof(*tf));
+    if ((binary = trace_is_binary(path)) < 0) {
+	fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+	return -1;
+    }
+    return binary ? map_bin(path, tf) : read_rep(path, tf);
+}
+
+/*
+ * trace_close - Release what trace_open acquired
+ */
+void trace_close(tracefile_t *tf)
+{
+    if (tf->map != NULL)
+	munmap(tf->map, tf->maplen);
+    free(tf->ops);
+    memset(tf, 0, sizeof(*tf));
+}
+
+/*
+ * read_rep_op - Parse the next request line of a text trace into *op.
+ *     Returns 1, 0 at the end of the file, or -1 for a bogus line.
+ */
+static int read_rep_op(FILE *fp, const char *path, traceop_t *op)
+{
+    char type[MAXLINE];
+    unsigned index = 0, size = 0, region = 0;
+
+    if (fscanf(fp, "%s", type) == EOF)
+	return 0;
+    switch(type[0]) {
+    case 'a':
+	fscanf(fp, "%u %u", &index, &size);
+	op->type = ALLOC;
+	break;
+    case 'r':
+	fscanf(fp, "%u %u", &index, &size);
+	op->type = REALLOC;
+	break;
+    case 'h':
+	fscanf(fp, "%u %u", &index, &size);
+	op->type = HALLOC;
+	break;
+    case 'f':
+	fscanf(fp, "%u", &index);
+	op->type = FREE;
+	break;
+    case 'c':
+	op->type = COMPACT;
+	break;
+    case 'n':
+	fscanf(fp, "%u", &region);
+	op->type = RCREATE;
+	break;
+    case 'd':
+	fscanf(fp, "%u", &region);
+	op->type = RDESTROY;
+	break;
+    case 'b':
+	fscanf(fp, "%u %u %u", &region, &index, &size);
+	op->type = RALLOC;
+	break;
+    case 't':
+	fscanf(fp, "%u", &index);
+	op->type = THREAD;
+	break;
+    case 's':
+	fscanf(fp, "%u", &index);
+	op->type = POST;
+	break;
+    case 'w':
+	fscanf(fp, "%u", &index);
+	op->type = WAIT;
+	break;
+    default:
+	fprintf(stderr, "Bogus type character (%c) in tracefile %s\n",
+		type[0], path);
+	return -1;
+    }
+    op->index = index;
+    op->size = size;
+    op->region = region;
+    return 1;
+}
+
+/*
+ * read_rep_header - Parse the four header lines of a text trace
+ */
+static int read_rep_header(FILE *fp, const char *path, tracehdr_t *hdr)
+{
+    if (fscanf(fp, "%u %u %u %u", &hdr->sugg_heapsize, &hdr->num_ids,
+	       &hdr->num_ops, &hdr->weight) != 4) {
+	fprintf(stderr, "Bad header in tracefile %s\n", path);
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * read_rep - Parse a text trace into an array of ops
+ */
+static int read_rep(const char *path, tracefile_t *tf)
+{
+    FILE *fp;
+    traceop_t *op;
+    unsigned max_index = 0;
+    unsigned max_region = 0;
+    int have_regions = 0;
+    unsigned op_index;
+    int rc;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+	fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+	return -1;
+    }
+    if (read_rep_header(fp, path, &tf->hdr) < 0) {
+	fclose(fp);
+	return -1;
+    }
+
+    /* We'll store each request line in the trace in this array */
+    if ((tf->ops = (traceop_t *)
+	 malloc((tf->hdr.num_ops + 1) * sizeof(traceop_t))) == NULL) {
+	fprintf(stderr, "Out of memory reading %s\n", path);
+	fclose(fp);
+	return -1;
+    }
+
+    /* read every request line in the trace file */
+    for (op_index = 0; op_index <= tf->hdr.num_ops; op_index++) {
+	op = &tf->ops[op_index];
+	if ((rc = read_rep_op(fp, path, op)) <= 0)
+	    break;
+	if (TRACE_HAS_INDEX(op->type))
+	    max_index = ((unsigned)op->index > max_index) ? op->index : max_index;
+	if (TRACE_HAS_REGION(op->type)) {
+	    max_region = ((unsigned)op->region > max_region) ? 
+		op->region : max_region;
+	    have_regions = 1;
+	}
+    }
+    fclose(fp);
+    if (rc < 0 || (max_index != tf->hdr.num_ids - 1) || 
+	(op_index != tf->hdr.num_ops)) {
+	if (rc >= 0)
+	    fprintf(stderr, "Header of tracefile %s does not match its ops\n", 
+		    path);
+	free(tf->ops);
+	tf->ops = NULL;
+	return -1;
+    }
+
+    /* Regions are numbered separately from blocks */
+    tf->hdr.num_regions = have_regions ? max_region + 1 : 0;
+    return 0;
+}
+
+/*
+ * map_bin - Map a binary trace and check that its ops are well formed,
+ *     so that trace_next can decode them without any checks
+ */
+static int map_bin(const char *path, tracefile_t *tf)
+{
+    int fd;
+    struct stat st;
+    const unsigned char *p, *end;
+    uint32_t n, b, d, v, index = 0;
+    int type;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+	return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(tracehdr_t)) {
+	fprintf(stderr, "Truncated binary trace %s\n", path);
+	close(fd);
+	return -1;
+    }
+    tf->maplen = st.st_size;
+    tf->map = mmap(NULL, tf->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (tf->map == MAP_FAILED) {
+	fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+	tf->map = NULL;
+	return -1;
+    }
+
+    /* The trace is replayed several times over, so read it all in now */
+    madvise(tf->map, tf->maplen, MADV_WILLNEED);
+
+    memcpy(&tf->hdr, tf->map, sizeof(tracehdr_t));
+    if (tf->hdr.version != TRACE_VERSION) {
+	fprintf(stderr, "Binary trace %s has version %u, not %u\n", path,
+		tf->hdr.version, TRACE_VERSION);
+	goto bad;
+    }
+    tf->packed = (const unsigned char *)tf->map + sizeof(tracehdr_t);
+    tf->packed_end = (const unsigned char *)tf->map + tf->maplen;
+
+    /* Decode every op once with bounds checks */
+    p = tf->packed;
+    end = tf->packed_end;
+    for (n = 0; p < end; n++) {
+	b = *p++;
+	type = TRACE_TYPE(b);
+	if (type == COMPACT && (b >> TRACE_TYPE_BITS)) {
+	    if ((b >> TRACE_TYPE_BITS) > WAIT - THREAD + 1 ||
+		(p = get_varint(p, end, &v)) == NULL || v > INT_MAX)
+		break;
+	    continue;
+	}
+	if (TRACE_HAS_INDEX(type)) {
+	    d = b >> TRACE_TYPE_BITS;
+	    if (d == TRACE_DELTA_ESC && (p = get_varint(p, end, &d)) == NULL)
+		break;
+	    index += (d >> 1) ^ -(d & 1);
+	    if (index >= tf->hdr.num_ids)
+		break;
+	}
+	else if (b >> TRACE_TYPE_BITS)
+	    break;
+	if (TRACE_HAS_SIZE(type) &&
+	    ((p = get_varint(p, end, &v)) == NULL || v > INT_MAX))
+	    break;
+	if (TRACE_HAS_REGION(type) &&
+	    ((p = get_varint(p, end, &v)) == NULL || v >= tf->hdr.num_regions))
+	    break;
+    }
+    if (p != end || n != tf->hdr.num_ops) {
+	fprintf(stderr, "Corrupt binary trace %s at op %u\n", path, n);
+	goto bad;
+    }
+    return 0;
+
+ bad:
+    munmap(tf->map, tf->maplen);
+    tf->map = NULL;
+    return -1;
+}
+
+/*
+ * read_bin_op - Decode the next packed op of a binary trace from a
+ *     stream into *op. Returns 1, 0 at the end of the file, or -1 if
+ *     the op is cut off or malformed.
+ */
+static int read_bin_op(FILE *fp, uint32_t *index, traceop_t *op)
+{
+    int b, type;
+    uint32_t d;
+
+    if ((b = getc(fp)) == EOF)
+	return 0;
+    type = TRACE_TYPE(b);
+    op->type = type;
+    op->index = op->size = op->region = 0;
+    if (type == COMPACT && (b >> TRACE_TYPE_BITS)) {
+	if ((b >> TRACE_TYPE_BITS) > WAIT - THREAD + 1 ||
+	    get_varint_fp(fp, &d) < 0 || d > INT_MAX)
+	    return -1;
+	op->type = THREAD + (b >> TRACE_TYPE_BITS) - 1;
+	op->index = d;
+	return 1;
+    }
+    if (TRACE_HAS_INDEX(type)) {
+	d = b >> TRACE_TYPE_BITS;
+	if (d == TRACE_DELTA_ESC && get_varint_fp(fp, &d) < 0)
+	    return -1;
+	*index += (d >> 1) ^ -(d & 1);
+	if (*index > INT_MAX)
+	    return -1;
+	op->index = *index;
+    }
+    else if (b >> TRACE_TYPE_BITS)
+	return -1;
+    if (TRACE_HAS_SIZE(type)) {
+	if (get_varint_fp(fp, &d) < 0 || d > INT_MAX)
+	    return -1;
+	op->size = d;
+    }
+    if (TRACE_HAS_REGION(type)) {
+	if (get_varint_fp(fp, &d) < 0 || d > INT_MAX)
+	    return -1;
+	op->region = d;
+    }
+    return 1;
+}
+
+/*
+ * fill_chunk - Decode up to TRACE_CHUNK ops from the stream into ops.
+ *     Returns how many, or -1 after printing why the trace is bad.
+ */
+static int fill_chunk(tracestream_t *ts, traceop_t *ops)
+{
+    int n, rc = 0;
+
+    for (n = 0; n < TRACE_CHUNK; n++) {
+	rc = ts->binary ? read_bin_op(ts->fp, &ts->index, &ops[n]) :
+	    read_rep_op(ts->fp, ts->path, &ops[n]);
+	if (rc <= 0)
+	    break;
+    }
+    if (rc < 0) {
+	if (ts->binary)
+	    fprintf(stderr, "Corrupt binary trace %s at op %lu\n", ts->path,
+		    ts->ops_read + n);
+	return -1;
+    }
+    ts->ops_read += n;
+    return n;
+}
+
+/*
+ * stream_reader - Body of the read-ahead thread. It decodes chunks into
+ *     the two buffers in turn, each as soon as the caller hands it back,
+ *     and stops after the chunk that hits the end of the trace.
+ */
+static void *stream_reader(void *arg)
+{
+    tracestream_t *ts = (tracestream_t *)arg;
+    int b = 0, n;
+
+    do {
+	pthread_mutex_lock(&ts->lock);
+	while (ts->count[b] != TRACE_EMPTY && !ts->stop)
+	    pthread_cond_wait(&ts->cond, &ts->lock);
+	pthread_mutex_unlock(&ts->lock);
+	if (ts->stop)
+	    break;
+
+	n = fill_chunk(ts, ts->buf[b]);
+
+	pthread_mutex_lock(&ts->lock);
+	ts->count[b] = n;
+	pthread_cond_broadcast(&ts->cond);
+	pthread_mutex_unlock(&ts->lock);
+	b ^= 1;
+    } while (n > 0);
+    return NULL;
+}
+
+/*
+ * trace_stream_open - Open the trace at path for reading a chunk at a
+ *     time, with the next chunk read ahead in the background. Returns
+ *     0, or -1 after printing why the trace could not be opened.
+ */
+int trace_stream_open(const char *path, tracestream_t *ts)
+{
+    int binary;
+
+    memset(ts, 0, sizeof(*ts));
+    if ((binary = trace_is_binary(path)) < 0 ||
+	(ts->fp = fopen(path, "r")) == NULL) {
+	fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+	return -1;
+    }
+    ts->binary = binary;
+    ts->path = path;
+    if (binary) {
+	if (fread(&ts->hdr, sizeof(tracehdr_t), 1, ts->fp) != 1 ||
+	    ts->hdr.version != TRACE_VERSION) {
+	    fprintf(stderr, "Bad header in binary trace %s\n", path);
+	    fclose(ts->fp);
+	    return -1;
+	}
+    }
+    else if (read_rep_header(ts->fp, path, &ts->hdr) < 0) {
+	fclose(ts->fp);
+	return -1;
+    }
+
+    if ((ts->buf[0] = malloc(2 * TRACE_CHUNK * sizeof(traceop_t))) == NULL) {
+	fprintf(stderr, "Out of memory reading %s\n", path);
+	fclose(ts->fp);
+	return -1;
+    }
+    ts->buf[1] = ts->buf[0] + TRACE_CHUNK;
+    ts->count[0] = ts->count[1] = TRACE_EMPTY;
+    ts->cur = -1;
+    pthread_mutex_init(&ts->lock, NULL);
+    pthread_cond_init(&ts->cond, NULL);
+    if (pthread_create(&ts->reader, NULL, stream_reader, ts) != 0) {
+	fprintf(stderr, "Could not start the reader of %s\n", path);
+	pthread_mutex_destroy(&ts->lock);
+	pthread_cond_destroy(&ts->cond);
+	free(ts->buf[0]);
+	fclose(ts->fp);
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * trace_stream_next - Hand back the chunk returned by the last call and
+ *     point *ops at the next one. Returns the number of ops in it, 0 at
+ *     the end of the trace, or -1 if the trace turned out to be bad.
+ */
+int trace_stream_next(tracestream_t *ts, traceop_t **ops)
+{
+    int n;
+
+    pthread_mutex_lock(&ts->lock);
+    if (ts->cur >= 0) {
+	if (ts->count[ts->cur] <= 0) {  /* stay at the end */
+	    n = ts->count[ts->cur];
+	    pthread_mutex_unlock(&ts->lock);
+	    return n;
+	}
+	ts->count[ts->cur] = TRACE_EMPTY;
+	pthread_cond_broadcast(&ts->cond);
+    }
+    ts->cur = (ts->cur + 1) & 1;
+    while (ts->count[ts->cur] == TRACE_EMPTY)
+	pthread_cond_wait(&ts->cond, &ts->lock);
+    n = ts->count[ts->cur];
+    pthread_mutex_unlock(&ts->lock);
+
+    *ops = ts->buf[ts->cur];
+    return n;
+}
+
+/*
+ * trace_stream_close - Stop the reader and release the stream
+ */
+void trace_stream_close(tracestream_t *ts)
+{
+    pthread_mutex_lock(&ts->lock);
+    ts->stop = 1;
+    pthread_cond_broadcast(&ts->cond);
+    pthread_mutex_unlock(&ts->lock);
+    pthread_join(ts->reader, NULL);
+    pthread_mutex_destroy(&ts->lock);
+    pthread_cond_destroy(&ts->cond);
+    free(ts->buf[0]);
+    fclose(ts->fp);
+}
+
+/*
+ * get_varint - Decode a varint at p without reading past end. Returns
+ *     the byte after it, or NULL if it is cut off or too long.
+ */
+static const unsigned char *get_varint(const unsigned char *p,
+				       const unsigned char *end, uint32_t *v)
+{
+    int shift;
+
+    *v = 0;
+    for (shift = 0; p < end && shift < 35; shift += 7) {
+	*v |= (uint32_t)(*p & 0x7F) << shift;
+	if (!(*p++ & 0x80))
+	    return p;
+    }
+    return NULL;
+}
+
+/*
+ * get_varint_fp - Decode a varint from a stream. Returns 0, or -1 if it
+ *     is cut off or too long.
+ */
+static int get_varint_fp(FILE *fp, uint32_t *v)
+{
+    int c, shift;
+
+    *v = 0;
+    for (shift = 0; shift < 35; shift += 7) {
+	if ((c = getc(fp)) == EOF)
+	    return -1;
+	*v |= (uint32_t)(c & 0x7F) << shift;
+	if (!(c & 0x80))
+	    return 0;
+    }
+    return -1;
+}
+
+/*
+ * put_varint - Write v as a LEB128 varint
+ */
+static void put_varint(FILE *fp, uint32_t v)
+{
+    while (v >= 0x80) {
+	putc((v & 0x7F) | 0x80, fp);
+	v >>= 7;
+    }
+    putc(v, fp);
+}
+
+/*
+ * trace_put_header - Write the header of a trace in binary or text form.
+ *     A writer that learns the counts only at the end writes the header
+ *     first with padded set, and again over it once they are known: a
+ *     padded text header gives each count a fixed width, which fscanf
+ *     skips over, and a binary header has a fixed size anyway.
+ */
+void trace_put_header(FILE *fp, const tracehdr_t *hdr, int binary, 
+		      int padded)
+{
+    tracehdr_t h = *hdr;
+
+    if (binary) {
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.version = TRACE_VERSION;
+	fwrite(&h, sizeof(h), 1, fp);
+    }
+    else if (padded)
+	fprintf(fp, "%-10u\n%-10u\n%-10u\n%-10u\n", h.sugg_heapsize,
+		h.num_ids, h.num_ops, h.weight);
+    else
+	fprintf(fp, "%u\n%u\n%u\n%u\n", h.sugg_heapsize, h.num_ids,
+		h.num_ops, h.weight);
+}
+
+/*
+ * trace_put_op - Write one op in binary or text form. *index carries
+ *     the index of the last op between calls, and starts at 0.
+ */
+void trace_put_op(FILE *fp, const traceop_t *op, uint32_t *index, int binary)
+{
+    uint32_t d = 0;
+
+    if (!binary) {
+	switch (op->type) {
+	case ALLOC:
+	    fprintf(fp, "a %d %d\n", op->index, op->size);
+	    break;
+	case REALLOC:
+	    fprintf(fp, "r %d %d\n", op->index, op->size);
+	    break;
+	case HALLOC:
+	    fprintf(fp, "h %d %d\n", op->index, op->size);
+	    break;
+	case FREE:
+	    fprintf(fp, "f %d\n", op->index);
+	    break;
+	case COMPACT:
+	    fprintf(fp, "c\n");
+	    break;
+	case RCREATE:
+	    fprintf(fp, "n %d\n", op->region);
+	    break;
+	case RALLOC:
+	    fprintf(fp, "b %d %d %d\n", op->region, op->index, op->size);
+	    break;
+	case RDESTROY:
+	    fprintf(fp, "d %d\n", op->region);
+	    break;
+	case THREAD:
+	    fprintf(fp, "t %d\n", op->index);
+	    break;
+	case POST:
+	    fprintf(fp, "s %d\n", op->index);
+	    break;
+	case WAIT:
+	    fprintf(fp, "w %d\n", op->index);
+	    break;
+	}
+	return;
+    }
+
+    if (TRACE_IS_SYNC(op->type)) {
+	putc(COMPACT | ((op->type - THREAD + 1) << TRACE_TYPE_BITS), fp);
+	put_varint(fp, op->index);
+	return;
+    }
+
+    if (TRACE_HAS_INDEX(op->type)) {
+	d = (uint32_t)op->index - *index;
+	d = (d << 1) ^ -(d >> 31);   /* zigzag */
+	*index = op->index;
+    }
+    if (d < TRACE_DELTA_ESC)
+	putc(op->type | (d << TRACE_TYPE_BITS), fp);
+    else {
+	putc(op->type | (TRACE_DELTA_ESC << TRACE_TYPE_BITS), fp);
+	put_varint(fp, d);
+    }
+    if (TRACE_HAS_SIZE(op->type))
+	put_varint(fp, op->size);
+    if (TRACE_HAS_REGION(op->type))
+	put_varint(fp, op->region);
+}
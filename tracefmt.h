@@ -0,0 +1,179 @@
+/*
+ * tracefmt.h - Trace files, shared by mdriver and tracecvt.
+ *
+ * A trace is either a text .rep file or a packed binary file that
+ * begins with TRACE_MAGIC. trace_open tells them apart by the magic
+ * number. A binary trace is mapped read-only and its ops are decoded
+ * in place by trace_next as the trace is replayed; nothing is copied.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC, HALLOC, COMPACT,
+	  RCREATE, RALLOC, RDESTROY,
+	  THREAD, POST, WAIT} type;       /* type of request */
+    int index;                        /* index for free() to use later, or
+					 the thread or event of a THREAD,
+					 POST or WAIT */
+    int size;                         /* byte size of alloc/realloc request */
+    int region;                       /* region of a region request */
+} traceop_t;
+
+/*
+ * Header of a binary trace. The numbers are in the byte order of the
+ * host that wrote the file; a file from a host of the other order
+ * reads as a wrong version and is rejected.
+ */
+#define TRACE_MAGIC    "mmtrace"  /* with its NUL, fills magic[] */
+#define TRACE_VERSION  1
+
+typedef struct {
+    char magic[8];           /* TRACE_MAGIC */
+    uint32_t version;        /* TRACE_VERSION */
+    uint32_t sugg_heapsize;  /* suggested heap size (unused) */
+    uint32_t num_ids;        /* number of alloc/realloc ids */
+    uint32_t num_ops;        /* number of distinct requests */
+    uint32_t weight;         /* weight for this trace (unused) */
+    uint32_t num_regions;    /* number of region ids */
+} tracehdr_t;
+
+/*
+ * Each packed op starts with one byte that holds the type in its low
+ * three bits. The high five bits hold the zigzag-coded difference
+ * between the op's index and the index of the last op that had one,
+ * or 31 if the difference follows as a varint. After that come the
+ * size and then the region, as LEB128 varints, for the types that
+ * have them. A COMPACT byte with high bits 1, 2 or 3 is a THREAD, POST
+ * or WAIT instead, with its thread or event following as a varint.
+ */
+#define TRACE_TYPE_BITS  3
+#define TRACE_DELTA_ESC  31
+#define TRACE_TYPE(b)    ((b) & ((1 << TRACE_TYPE_BITS) - 1))
+
+#define TRACE_HAS_INDEX(t)  ((t) == ALLOC || (t) == FREE || (t) == REALLOC || \
+			     (t) == HALLOC || (t) == RALLOC)
+#define TRACE_HAS_SIZE(t)   ((t) == ALLOC || (t) == REALLOC || \
+			     (t) == HALLOC || (t) == RALLOC)
+#define TRACE_HAS_REGION(t) ((t) == RCREATE || (t) == RALLOC || (t) == RDESTROY)
+#define TRACE_IS_SYNC(t)    ((t) == THREAD || (t) == POST || (t) == WAIT)
+
+/* A trace opened by trace_open */
+typedef struct {
+    tracehdr_t hdr;                  /* counts, for either format */
+    traceop_t *ops;                  /* ops parsed from a text trace... */
+    const unsigned char *packed;     /* ... or the packed ops of a binary */
+    const unsigned char *packed_end; /*     trace, inside its mapping */
+    void *map;                       /* the mapping, NULL for a text trace */
+    size_t maplen;
+} tracefile_t;
+
+/* Walks the ops of a trace in order */
+typedef struct {
+    const traceop_t *op, *op_end;   /* next parsed op, or ... */
+    const unsigned char *p;         /* ... next packed op */
+    const unsigned char *end;
+    uint32_t index;                 /* index of the last packed op */
+} tracecur_t;
+
+/* A trace read a chunk at a time, with the next chunk read ahead */
+#define TRACE_CHUNK  65536  /* ops per chunk */
+#define TRACE_EMPTY  (-2)   /* count of a buffer the reader may fill */
+
+typedef struct {
+    FILE *fp;
+    const char *path;
+    int binary;               /* is this a binary trace? */
+    tracehdr_t hdr;           /* counts from the header */
+    uint32_t index;           /* index of the last packed op read */
+    unsigned long ops_read;   /* ops decoded so far */
+    traceop_t *buf[2];        /* the two chunk buffers ... */
+    int count[2];             /* ... and the ops in each, 0 at the end,
+				 -1 for a bad trace, or TRACE_EMPTY */
+    int cur;                  /* buffer the caller holds, -1 if none */
+    int stop;                 /* tells the reader to quit */
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} tracestream_t;
+
+int trace_is_binary(const char *path);
+int trace_open(const char *path, tracefile_t *tf);
+void trace_close(tracefile_t *tf);
+int trace_stream_open(const char *path, tracestream_t *ts);
+int trace_stream_next(tracestream_t *ts, traceop_t **ops);
+void trace_stream_close(tracestream_t *ts);
+void trace_put_header(FILE *fp, const tracehdr_t *hdr, int binary, 
+		      int padded);
+void trace_put_op(FILE *fp, const traceop_t *op, uint32_t *index, int binary);
+
+/*
+ * trace_varint - Decode a LEB128 varint at *pp and step past it. The
+ *     ops of a binary trace were checked by trace_open, so this need
+ *     not guard against running off the end.
+ */
+static inline uint32_t trace_varint(const unsigned char **pp)
+{
+    const unsigned char *p = *pp;
+    uint32_t v = *p & 0x7F;
+    int shift = 7;
+
+    while (*p++ & 0x80) {
+	v |= (uint32_t)(*p & 0x7F) << shift;
+	shift += 7;
+    }
+    *pp = p;
+    return v;
+}
+
+/* trace_start - Point c at the first op of tf */
+static inline void trace_start(tracecur_t *c, const tracefile_t *tf)
+{
+    c->op = tf->ops;
+    c->op_end = tf->ops ? tf->ops + tf->hdr.num_ops : NULL;
+    c->p = tf->packed;
+    c->end = tf->packed_end;
+    c->index = 0;
+}
+
+/*
+ * trace_next - Fetch the next op of the trace into *op. Returns 0 once
+ *     the trace is done.
+ */
+static inline int trace_next(tracecur_t *c, traceop_t *op)
+{
+    uint32_t b, d;
+
+    if (c->op != NULL) {
+	if (c->op == c->op_end)
+	    return 0;
+	*op = *c->op++;
+	return 1;
+    }
+    if (c->p == c->end)
+	return 0;
+
+    b = *c->p++;
+    op->type = TRACE_TYPE(b);
+    op->index = op->size = op->region = 0;
+    if (op->type == COMPACT && (b >> TRACE_TYPE_BITS)) {
+	op->type = THREAD + (b >> TRACE_TYPE_BITS) - 1;
+	op->index = trace_varint(&c->p);
+	return 1;
+    }
+    if (TRACE_HAS_INDEX(op->type)) {
+	d = b >> TRACE_TYPE_BITS;
+	if (d == TRACE_DELTA_ESC)
+	    d = trace_varint(&c->p);
+	c->index += (d >> 1) ^ -(d & 1);
+	op->index = c->index;
+    }
+    if (TRACE_HAS_SIZE(op->type))
+	op->size = trace_varint(&c->p);
+    if (TRACE_HAS_REGION(op->type))
+	op->region = trace_varint(&c->p);
+    return 1;
+}
@@ -0,0 +1,383 @@
+/*
+ * tracegen.c - Generate a synthetic trace with chosen distributions of
+ *     block sizes and lifetimes, so that particular behaviours of an
+ *     allocator can be stressed without a suite of recorded traces.
+ *
+ *     usage: tracegen [options] <outfile>
+ *
+ *     Time is counted in requests. Each block gets a size and a lifetime
+ *     when it is allocated, and is freed once its lifetime is up. Some
+ *     blocks instead grow by realloc a few times before they are freed.
+ *     A live-set target frees the blocks closest to death early when the
+ *     live bytes would go over it. -P starts a new phase: the options
+ *     after it apply from the given request on. Blocks still live at the
+ *     end are freed, so every id is allocated once and freed once.
+ *
+ *     The trace is written as it is generated, so it need not fit in
+ *     memory; only the live blocks are kept.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "tracefmt.h"
+
+#define MAXPHASES 64
+
+/* A distribution of sizes or lifetimes */
+typedef struct {
+    enum {UNIFORM, POWER, BIMODAL, POW2, EXP} kind;
+    double a, b, c;         /* parameters, as given by parse_dist */
+} dist_t;
+
+/* What to generate from request start on */
+typedef struct {
+    unsigned long start;    /* first request of the phase */
+    dist_t size;            /* block sizes */
+    dist_t life;            /* block lifetimes, in requests */
+    double chain_prob;      /* chance that a block grows by realloc */
+    double chain_growth;    /* factor it grows by each time */
+    int chain_len;          /* reallocs before it is freed */
+    unsigned long live_max; /* live-set target in bytes, 0 for none */
+} phase_t;
+
+/* A live block, kept in a heap ordered by the time of its next request */
+typedef struct {
+    unsigned long when;     /* time of its next realloc or its free */
+    int id;
+    int size;
+    int reallocs;           /* reallocs still to come */
+} block_t;
+
+static block_t *live;       /* min-heap of the live blocks */
+static long num_live, max_live;
+static unsigned long long rng_state = 0x2545F4914F6CDD1DULL;
+
+static void usage(void);
+static int parse_dist(char *s, dist_t *d, int for_life);
+static double uniform01(void);
+static double sample(const dist_t *d);
+static void push(const block_t *b);
+static void pop(block_t *b);
+
+int main(int argc, char **argv)
+{
+    phase_t phases[MAXPHASES], *ph;
+    int num_phases = 1, cur = 0;
+    unsigned long num_ops = 100000, t, live_bytes = 0, peak = 0;
+    tracehdr_t hdr;
+    traceop_t op;
+    block_t b;
+    uint32_t index = 0;
+    int c, due, binary = 0, next_id = 0;
+    char *end;
+    double s;
+    FILE *fp;
+
+    /* Defaults: small uniform sizes, exponential lifetimes */
+    memset(phases, 0, sizeof(phases));
+    ph = &phases[0];
+    ph->size.kind = UNIFORM;
+    ph->size.a = 1;
+    ph->size.b = 512;
+    ph->life.kind = EXP;
+    ph->life.a = 1000;
+    ph->chain_growth = 2;
+    ph->chain_len = 4;
+
+    while ((c = getopt(argc, argv, "n:s:l:r:L:P:S:bh")) != EOF) {
+	switch (c) {
+	case 'n': /* About how many requests to generate */
+	    num_ops = strtoul(optarg, &end, 10);
+	    if (*end != '\0' || num_ops < 2)
+		usage();
+	    break;
+	case 's': /* Size distribution */
+	    if (parse_dist(optarg, &ph->size, 0) < 0)
+		usage();
+	    break;
+	case 'l': /* Lifetime distribution */
+	    if (parse_dist(optarg, &ph->life, 1) < 0)
+		usage();
+	    break;
+	case 'r': /* Realloc growth chains, as P[:G[:K]] */
+	    ph->chain_prob = strtod(optarg, &end);
+	    if (*end == ':')
+		ph->chain_growth = strtod(end + 1, &end);
+	    if (*end == ':')
+		ph->chain_len = strtol(end + 1, &end, 10);
+	    if (*end != '\0' || ph->chain_prob < 0 || ph->chain_prob > 1 ||
+		ph->chain_growth <= 0 || ph->chain_len < 1)
+		usage();
+	    break;
+	case 'L': /* Live-set target in bytes */
+	    ph->live_max = strtoul(optarg, &end, 10);
+	    if (*end != '\0')
+		usage();
+	    break;
+	case 'P': /* Start a new phase at this request */
+	    if (num_phases == MAXPHASES) {
+		fprintf(stderr, "At most %d phases\n", MAXPHASES);
+		exit(1);
+	    }
+	    phases[num_phases] = *ph;
+	    ph = &phases[num_phases++];
+	    ph->start = strtoul(optarg, &end, 10);
+	    if (*end != '\0' || ph->start <= ph[-1].start)
+		usage();
+	    break;
+	case 'S': /* Random seed */
+	    rng_state = strtoull(optarg, &end, 10) * 0x9E3779B97F4A7C15ULL + 1;
+	    if (*end != '\0')
+		usage();
+	    break;
+	case 'b': /* Write a binary trace */
+	    binary = 1;
+	    break;
+	case 'h':
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1)
+	usage();
+
+    if ((fp = fopen(argv[optind], "w")) == NULL) {
+	fprintf(stderr, "Could not create %s: %s\n", argv[optind],
+		strerror(errno));
+	exit(1);
+    }
+
+    /* The counts are known only at the end; the header is written again */
+    memset(&hdr, 0, sizeof(hdr));
+    trace_put_header(fp, &hdr, binary, 1);
+
+    /* Each step makes one request; stop early enough to free the rest */
+    for (t = 0; t + num_live < num_ops; t++) {
+	while (cur + 1 < num_phases && phases[cur + 1].start <= t)
+	    cur++;
+	ph = &phases[cur];
+	op.region = 0;
+
+	if (num_live > 0 && (live[0].when <= t ||
+			     (ph->live_max && live_bytes > ph->live_max))) {
+	    /* A block's time is up, or the live set is over its target */
+	    due = (live[0].when <= t);
+	    pop(&b);
+	    op.index = b.id;
+	    if (b.reallocs > 0 && due) {
+		s = b.size * ph->chain_growth;
+		op.type = REALLOC;
+		op.size = (s < 1) ? 1 : (s > INT32_MAX) ? INT32_MAX : (int)s;
+		live_bytes += op.size - b.size;
+		b.size = op.size;
+		b.reallocs--;
+		b.when = t + 1 + (unsigned long)(sample(&ph->life) /
+						 (ph->chain_len + 1));
+		push(&b);
+	    }
+	    else {
+		op.type = FREE;
+		op.size = 0;
+		live_bytes -= b.size;
+	    }
+	}
+	else {
+	    /* Allocate a new block */
+	    s = sample(&ph->size);
+	    b.id = next_id++;
+	    b.size = (s < 1) ? 1 : (s > INT32_MAX) ? INT32_MAX : (int)s;
+	    b.reallocs = (uniform01() < ph->chain_prob) ? ph->chain_len : 0;
+	    s = sample(&ph->life);
+	    if (b.reallocs)
+		s /= ph->chain_len + 1;
+	    b.when = t + 1 + (unsigned long)s;
+	    push(&b);
+	    live_bytes += b.size;
+	    op.type = ALLOC;
+	    op.index = b.id;
+	    op.size = b.size;
+	}
+	if (live_bytes > peak)
+	    peak = live_bytes;
+	trace_put_op(fp, &op, &index, binary);
+    }
+
+    /* Free what is left, in order of death */
+    op.type = FREE;
+    op.size = op.region = 0;
+    for (; num_live > 0; t++) {
+	pop(&b);
+	op.index = b.id;
+	trace_put_op(fp, &op, &index, binary);
+    }
+
+    hdr.sugg_heapsize = (peak > UINT32_MAX) ? UINT32_MAX : peak;
+    hdr.num_ids = next_id;
+    hdr.num_ops = t;
+    hdr.weight = 1;
+    rewind(fp);
+    trace_put_header(fp, &hdr, binary, 1);
+    if (ferror(fp) || fclose(fp) != 0) {
+	fprintf(stderr, "Could not write %s: %s\n", argv[optind],
+		strerror(errno));
+	exit(1);
+    }
+    free(live);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracegen [options] <outfile>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-n <N>      Generate about N requests (100000).\n");
+    fprintf(stderr, "\t-s <dist>   Block sizes (uniform:1:512).\n");
+    fprintf(stderr, "\t-l <dist>   Block lifetimes in requests (exp:1000).\n");
+    fprintf(stderr, "\t-r P[:G[:K]] Grow a block with chance P by G times,"
+	    " K times (0:2:4).\n");
+    fprintf(stderr, "\t-L <bytes>  Keep the live set under this many bytes.\n");
+    fprintf(stderr, "\t-P <N>      Start a new phase at request N.\n");
+    fprintf(stderr, "\t-S <seed>   Seed the random numbers.\n");
+    fprintf(stderr, "\t-b          Write a binary trace.\n");
+    fprintf(stderr, "Distributions\n");
+    fprintf(stderr, "\tuniform:MIN:MAX       Any value in [MIN, MAX].\n");
+    fprintf(stderr, "\tpower:MIN:MAX:ALPHA   Pareto on [MIN, MAX].\n");
+    fprintf(stderr, "\tbimodal:A:B:P         A with chance P, else B (sizes).\n");
+    fprintf(stderr, "\tpow2:LO:HI            2^k for k in [LO, HI] (sizes).\n");
+    fprintf(stderr, "\texp:MEAN              Exponential (lifetimes).\n");
+    exit(1);
+}
+
+/*
+ * parse_dist - Parse a distribution named by the user. Returns -1 if
+ *     it is malformed or doesn't fit what it is for.
+ */
+static int parse_dist(char *s, dist_t *d, int for_life)
+{
+    char *end;
+    int nargs, n = 0;
+    double v[3] = {0, 0, 0};
+
+    if (!strncmp(s, "uniform:", 8)) {
+	d->kind = UNIFORM;
+	nargs = 2;
+    }
+    else if (!strncmp(s, "power:", 6)) {
+	d->kind = POWER;
+	nargs = 3;
+    }
+    else if (!strncmp(s, "bimodal:", 8) && !for_life) {
+	d->kind = BIMODAL;
+	nargs = 3;
+    }
+    else if (!strncmp(s, "pow2:", 5) && !for_life) {
+	d->kind = POW2;
+	nargs = 2;
+    }
+    else if (!strncmp(s, "exp:", 4) && for_life) {
+	d->kind = EXP;
+	nargs = 1;
+    }
+    else
+	return -1;
+
+    s = strchr(s, ':');
+    while (n < nargs && *s == ':') {
+	v[n++] = strtod(s + 1, &end);
+	if (end == s + 1)
+	    return -1;
+	s = end;
+    }
+    if (n != nargs || *s != '\0')
+	return -1;
+    d->a = v[0];
+    d->b = v[1];
+    d->c = v[2];
+
+    switch (d->kind) {
+    case UNIFORM:
+	return (d->a < 0 || d->b < d->a) ? -1 : 0;
+    case POWER:
+	return (d->a <= 0 || d->b < d->a || d->c <= 0) ? -1 : 0;
+    case BIMODAL:
+	return (d->a < 1 || d->b < 1 || d->c < 0 || d->c > 1) ? -1 : 0;
+    case POW2:
+	return (d->a < 0 || d->b < d->a || d->b > 30) ? -1 : 0;
+    default:
+	return (d->a < 0) ? -1 : 0;
+    }
+}
+
+/* uniform01 - A random number in [0, 1), by xorshift64* */
+static double uniform01(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* sample - Draw a value from d */
+static double sample(const dist_t *d)
+{
+    double u = uniform01(), lo, hi;
+
+    switch (d->kind) {
+    case UNIFORM:
+	return floor(d->a + u * (d->b - d->a + 1));
+    case POWER:
+	/* Invert the CDF of a Pareto bounded to [a, b] */
+	lo = pow(d->a, -d->c);
+	hi = pow(d->b, -d->c);
+	return floor(pow(lo - u * (lo - hi), -1 / d->c));
+    case BIMODAL:
+	return (u < d->c) ? d->a : d->b;
+    case POW2:
+	return ldexp(1, (int)(d->a + u * (d->b - d->a + 1)));
+    default:
+	return -d->a * log(1 - u);
+    }
+}
+
+/* push - Add a block to the heap of live blocks */
+static void push(const block_t *b)
+{
+    long i, parent;
+
+    if (num_live == max_live) {
+	max_live = max_live ? 2 * max_live : 1024;
+	if ((live = (block_t *)realloc(live, max_live * sizeof(block_t))) == NULL) {
+	    fprintf(stderr, "Out of memory for %ld live blocks\n", max_live);
+	    exit(1);
+	}
+    }
+    for (i = num_live++; i > 0; i = parent) {
+	parent = (i - 1) / 2;
+	if (live[parent].when <= b->when)
+	    break;
+	live[i] = live[parent];
+    }
+    live[i] = *b;
+}
+
+/* pop - Take the block whose next request comes first off the heap */
+static void pop(block_t *b)
+{
+    block_t last = live[--num_live];
+    long i = 0, child;
+
+    *b = live[0];
+    while ((child = 2 * i + 1) < num_live) {
+	if (child + 1 < num_live && live[child + 1].when < live[child].when)
+	    child++;
+	if (last.when <= live[child].when)
+	    break;
+	live[i] = live[child];
+	i = child;
+    }
+    live[i] = last;
+}